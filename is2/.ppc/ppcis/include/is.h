@@ -1,5 +1,8 @@
 #pragma once
 
+#include <memory>
+#include <vector>
+
 struct Result {
     int y0;
     int x0;
@@ -10,3 +13,51 @@ struct Result {
 };
 
 Result segment(int ny, int nx, const float *data);
+
+#ifdef PPC_STATS
+// Instrumentation of `segment` and `Segmenter::next`, accumulated over calls.
+// Only available when compiled with PPC_STATS.
+struct SegmentStats {
+    long long setup_ns;   // integral images
+    long long search_ns;  // finding the best rectangle
+    long long colour_ns;  // colours of the result
+    long long candidates; // rectangles scored exactly
+    long long bounds;     // boxes of rectangles bounded (Segmenter only)
+};
+
+extern SegmentStats segment_stats;
+#endif
+
+// Streaming segmentation of a sequence of equally sized frames. Each call to
+// `next` returns the same result as `segment` would for that frame, but the
+// previous frame's optimum is used as the starting bound of the search.
+class Segmenter {
+  public:
+    Segmenter(int ny, int nx);
+    ~Segmenter();
+
+    Result next(const float *data);
+
+  private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// One rectangle of a k-segment result, with its own colour.
+struct Segment {
+    int y0;
+    int x0;
+    int y1;
+    int x1;
+    float color[3];
+};
+
+struct MultiResult {
+    std::vector<Segment> segments;
+    float outer[3];
+    double cost;
+};
+
+// Partition into at most k non-overlapping monochromatic rectangles and a
+// monochromatic background, minimising the sum of squared errors.
+MultiResult segment_k(int ny, int nx, int k, const float *data);
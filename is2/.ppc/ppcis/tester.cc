@@ -29,6 +29,27 @@ static double total_cost(int ny, int nx, const float *data, const Result &res) {
     return error[0] + error[1] + error[2];
 }
 
+// Cost of a k-segment result: pixels outside all segments are compared against `outer`.
+static double total_cost_k(int ny, int nx, const float *data, const std::vector<Segment> &segments, const float (&outer)[3]) {
+    double error[3] = {};
+    for (int y = 0; y < ny; y++) {
+        for (int x = 0; x < nx; x++) {
+            const float *color = outer;
+            for (const Segment &s : segments) {
+                if (s.x0 <= x && x < s.x1 && s.y0 <= y && y < s.y1) {
+                    color = s.color;
+                    break;
+                }
+            }
+            for (int c = 0; c < 3; c++) {
+                double diff = (double)color[c] - (double)data[c + 3 * x + 3 * nx * y];
+                error[c] += diff * diff;
+            }
+        }
+    }
+    return error[0] + error[1] + error[2];
+}
+
 static void dump(const float (&a)[3]) {
     *stream << std::scientific << a[0] << "," << std::scientific << a[1] << "," << std::scientific << a[2];
 }
@@ -55,39 +76,42 @@ static bool equal(const float (&a)[3], const float (&b)[3]) {
     return close(a[0], b[0]) && close(a[1], b[1]) && close(a[2], b[2]);
 }
 
+static bool accept(int ny, int nx, const Result &e, const Result &r, const float *data) {
+    if (e.y0 == r.y0 && e.x0 == r.x0 && e.y1 == r.y1 && e.x1 == r.x1 && equal(e.outer, r.outer) && equal(e.inner, r.inner)) {
+        return true;
+    }
+    double expected_cost = total_cost(ny, nx, data, e);
+    double returned_cost = total_cost(ny, nx, data, r);
+    double ub = expected_cost * (1.0 + RELATIVE_THRESHOLD);
+    double lb = expected_cost * (1.0 - RELATIVE_THRESHOLD);
+    return lb < returned_cost && returned_cost < ub;
+}
+
 static void compare(bool is_test, int ny, int nx, const Result &e, const Result &r, const float *data) {
     if (is_test) {
-        if (e.y0 == r.y0 && e.x0 == r.x0 && e.y1 == r.y1 && e.x1 == r.x1 && equal(e.outer, r.outer) && equal(e.inner, r.inner)) {
+        if (accept(ny, nx, e, r, data)) {
             *stream << "result\tpass\n";
         } else {
-            double expected_cost = total_cost(ny, nx, data, e);
-            double returned_cost = total_cost(ny, nx, data, r);
-            double ub = expected_cost * (1.0 + RELATIVE_THRESHOLD);
-            double lb = expected_cost * (1.0 - RELATIVE_THRESHOLD);
-            if (lb < returned_cost && returned_cost < ub) {
-                *stream << "result\tpass\n";
-            } else {
-                bool small = ny * nx <= 200;
-                stream->precision(std::numeric_limits<float>::max_digits10 - 1);
-                *stream
-                    << "result\tfail\n"
-                    << "threshold\t" << std::scientific << THRESHOLD << '\n'
-                    << "ny\t" << ny << "\n"
-                    << "nx\t" << nx << "\n"
-                    << "what\texpected\n";
-                dump(e);
-                *stream << "what\tgot\n";
-                dump(r);
-                *stream << "size\t" << (small ? "small" : "large") << '\n';
-                if (small) {
-                    for (int y = 0; y < ny; ++y) {
-                        for (int x = 0; x < nx; ++x) {
-                            const float *p = &data[3 * x + 3 * nx * y];
-                            const float v[3] = {p[0], p[1], p[2]};
-                            *stream << "triple\t";
-                            dump(v);
-                            *stream << "\n";
-                        }
+            bool small = ny * nx <= 200;
+            stream->precision(std::numeric_limits<float>::max_digits10 - 1);
+            *stream
+                << "result\tfail\n"
+                << "threshold\t" << std::scientific << THRESHOLD << '\n'
+                << "ny\t" << ny << "\n"
+                << "nx\t" << nx << "\n"
+                << "what\texpected\n";
+            dump(e);
+            *stream << "what\tgot\n";
+            dump(r);
+            *stream << "size\t" << (small ? "small" : "large") << '\n';
+            if (small) {
+                for (int y = 0; y < ny; ++y) {
+                    for (int x = 0; x < nx; ++x) {
+                        const float *p = &data[3 * x + 3 * nx * y];
+                        const float v[3] = {p[0], p[1], p[2]};
+                        *stream << "triple\t";
+                        dump(v);
+                        *stream << "\n";
                     }
                 }
             }
@@ -98,6 +122,17 @@ static void compare(bool is_test, int ny, int nx, const Result &e, const Result
     *stream << std::flush;
 }
 
+#ifdef PPC_STATS
+static void print_stats() {
+    *stream
+        << "perf_is_setup_ns\t" << segment_stats.setup_ns << '\n'
+        << "perf_is_search_ns\t" << segment_stats.search_ns << '\n'
+        << "perf_is_colour_ns\t" << segment_stats.colour_ns << '\n'
+        << "perf_is_candidates\t" << segment_stats.candidates << '\n'
+        << "perf_is_bounds\t" << segment_stats.bounds << '\n';
+}
+#endif
+
 static void test(bool is_test, const ISTestCase &test) {
     TestCaseInstance data = test.generate();
 
@@ -105,15 +140,112 @@ static void test(bool is_test, const ISTestCase &test) {
     {
         ppc::setup_cuda_device();
         ppc::perf timer;
+#ifdef PPC_STATS
+        segment_stats = {};
+#endif
         timer.start();
         r = segment(data.Ny, data.Nx, data.Data.data());
         timer.stop();
         timer.print_to(*stream);
+#ifdef PPC_STATS
+        print_stats();
+#endif
         ppc::reset_cuda_device();
     }
     compare(is_test, data.Ny, data.Nx, data.Expected, r, data.Data.data());
 }
 
+// Runs a whole sequence through one `Segmenter`. The first frame with an unacceptable result is reported;
+// if there is none, the last frame is.
+static void test_sequence(bool is_test, const MovingRectSequence &sequence) {
+    std::vector<TestCaseInstance> frames = sequence.generate();
+    const TestCaseInstance &first = frames.front();
+
+    std::vector<Result> results(frames.size());
+    {
+        ppc::setup_cuda_device();
+        ppc::perf timer;
+#ifdef PPC_STATS
+        segment_stats = {};
+#endif
+        timer.start();
+        Segmenter segmenter(first.Ny, first.Nx);
+        for (std::size_t f = 0; f < frames.size(); ++f) {
+            results[f] = segmenter.next(frames[f].Data.data());
+        }
+        timer.stop();
+        timer.print_to(*stream);
+#ifdef PPC_STATS
+        print_stats();
+#endif
+        ppc::reset_cuda_device();
+    }
+
+    std::size_t reported = frames.size() - 1;
+    for (std::size_t f = 0; f < frames.size(); ++f) {
+        const TestCaseInstance &frame = frames[f];
+        if (!accept(frame.Ny, frame.Nx, frame.Expected, results[f], frame.Data.data())) {
+            reported = f;
+            break;
+        }
+    }
+    const TestCaseInstance &frame = frames[reported];
+    compare(is_test, frame.Ny, frame.Nx, frame.Expected, results[reported], frame.Data.data());
+}
+
+// Checks that the segments are valid and do not overlap, that the reported cost is the actual cost, and that
+// the cost is not worse than that of the planted rectangles.
+static void test_multi(bool is_test, const MultiRectTestCase &test, int k) {
+    auto generated = test.generate();
+    const TestCaseInstance &data = generated.first;
+    const std::vector<Result> &planted = generated.second;
+
+    MultiResult r;
+    {
+        ppc::setup_cuda_device();
+        ppc::perf timer;
+        timer.start();
+        r = segment_k(data.Ny, data.Nx, k, data.Data.data());
+        timer.stop();
+        timer.print_to(*stream);
+        ppc::reset_cuda_device();
+    }
+
+    if (!is_test) {
+        *stream << "result\tdone\n" << std::flush;
+        return;
+    }
+
+    bool valid = (int)r.segments.size() <= k;
+    for (std::size_t i = 0; i < r.segments.size(); ++i) {
+        const Segment &s = r.segments[i];
+        valid = valid && 0 <= s.y0 && s.y0 < s.y1 && s.y1 <= data.Ny && 0 <= s.x0 && s.x0 < s.x1 && s.x1 <= data.Nx;
+        for (std::size_t j = 0; j < i; ++j) {
+            const Segment &o = r.segments[j];
+            valid = valid && !(s.y0 < o.y1 && o.y0 < s.y1 && s.x0 < o.x1 && o.x0 < s.x1);
+        }
+    }
+
+    std::vector<Segment> expected;
+    for (const Result &p : planted) {
+        expected.push_back({p.y0, p.x0, p.y1, p.x1, {p.inner[0], p.inner[1], p.inner[2]}});
+    }
+    double expected_cost = total_cost_k(data.Ny, data.Nx, data.Data.data(), expected, data.Expected.outer);
+    double returned_cost = total_cost_k(data.Ny, data.Nx, data.Data.data(), r.segments, r.outer);
+    valid = valid && std::abs(returned_cost - r.cost) <= THRESHOLD * std::max(1.0, returned_cost);
+    valid = valid && returned_cost <= expected_cost * (1.0 + RELATIVE_THRESHOLD) + THRESHOLD;
+
+    if (valid) {
+        *stream << "result\tpass\n";
+    } else {
+        *stream
+            << "result\tfail\n"
+            << "ny\t" << data.Ny << "\n"
+            << "nx\t" << data.Nx << "\n";
+    }
+    *stream << std::flush;
+}
+
 int main(int argc, char **argv) {
     const char *ppc_output = std::getenv("PPC_OUTPUT");
     int ppc_output_fd = 0;
@@ -152,6 +284,20 @@ int main(int argc, char **argv) {
         CHECK_READ(input_file >> input_type);
     }
 
+    if (input_type == "structured-moving" || input_type == "structured-moving-binary") {
+        int ny, nx, frames;
+        CHECK_READ(input_file >> ny >> nx >> frames);
+        test_sequence(is_test, MovingRectSequence(ny, nx, frames, input_type == "structured-moving-binary"));
+        return 0;
+    }
+
+    if (input_type == "multi-rect") {
+        int ny, nx, k;
+        CHECK_READ(input_file >> ny >> nx >> k);
+        test_multi(is_test, MultiRectTestCase(ny, nx, k), k);
+        return 0;
+    }
+
     auto test_case = make_test_case(input_type, input_file);
     test(is_test, *test_case);
 
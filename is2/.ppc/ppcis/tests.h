@@ -170,6 +170,142 @@ class RectTestCase : public ISTestCase {
     bool WorstCase;
 };
 
+// A sequence of frames like in RectTestCase, in which the rectangle drifts by at most one pixel per edge
+// from one frame to the next. Used for testing the streaming `Segmenter`.
+class MovingRectSequence {
+  public:
+    MovingRectSequence(int ny, int nx, int frames, bool binary) : Ny(ny), Nx(nx), Frames(frames), Binary(binary) {
+        if (ny * nx <= 2 || frames < 1) {
+            throw std::invalid_argument("Invalid dimensions");
+        }
+    }
+
+    std::vector<TestCaseInstance> generate() const {
+        ppc::random rng(uint32_t(Ny) * 0x1234567 + uint32_t(Nx) * 0x89 + uint32_t(Frames));
+        Rect loc = RectTestCase(Ny, Nx, Binary, false).choose_location(rng);
+
+        // colours stay fixed for the whole sequence
+        float inner[3], outer[3];
+        if (Binary) {
+            bool flip = rng.get_uint64(0, 1);
+            for (int c = 0; c < 3; ++c) {
+                inner[c] = flip ? 0.0f : 1.0f;
+                outer[c] = flip ? 1.0f : 0.0f;
+            }
+        } else {
+            colours(rng, inner, outer);
+        }
+
+        std::vector<TestCaseInstance> frames;
+        for (int f = 0; f < Frames; ++f) {
+            if (f > 0) {
+                loc = move(rng, loc);
+            }
+            Result result{loc.Y0, loc.X0, loc.Y1, loc.X1, {}, {}};
+            for (int c = 0; c < 3; ++c) {
+                result.inner[c] = inner[c];
+                result.outer[c] = outer[c];
+            }
+
+            std::vector<float> data(3 * Ny * Nx);
+            for (int y = 0; y < Ny; ++y) {
+                for (int x = 0; x < Nx; ++x) {
+                    bool inside = loc.Y0 <= y && y < loc.Y1 && loc.X0 <= x && x < loc.X1;
+                    for (int c = 0; c < 3; ++c) {
+                        data[c + 3 * x + 3 * Nx * y] = inside ? inner[c] : outer[c];
+                    }
+                }
+            }
+            frames.push_back({Ny, Nx, std::move(data), result});
+        }
+        return frames;
+    }
+
+  private:
+    // Moves every edge by -1, 0 or +1; keeps the old location if the new one would be invalid or ambiguous.
+    Rect move(ppc::random &rng, Rect loc) const {
+        Rect next{loc.Y0 + rng.get_int32(-1, 1), loc.X0 + rng.get_int32(-1, 1),
+                  loc.Y1 + rng.get_int32(-1, 1), loc.X1 + rng.get_int32(-1, 1)};
+        if (next.Y0 < 0 || next.X0 < 0 || next.Y1 > Ny || next.X1 > Nx || next.Y0 >= next.Y1 || next.X0 >= next.X1) {
+            return loc;
+        }
+        if (next.Y0 == 0 && next.Y1 == Ny && (next.X0 == 0 || next.X1 == Nx)) {
+            return loc;
+        }
+        if (next.X0 == 0 && next.X1 == Nx && (next.Y0 == 0 || next.Y1 == Ny)) {
+            return loc;
+        }
+        return next;
+    }
+
+    int Ny, Nx, Frames;
+    bool Binary;
+};
+
+// A monochromatic background with up to k separated rectangles painted on, each in its own colour. The planted
+// rectangles have zero cost, so the optimum of the k-segment problem is known.
+class MultiRectTestCase {
+  public:
+    MultiRectTestCase(int ny, int nx, int k) : Ny(ny), Nx(nx), K(k) {
+        if (ny * nx <= 2 || k < 1) {
+            throw std::invalid_argument("Invalid dimensions");
+        }
+    }
+
+    // Returns the image and the planted rectangles; the colour of the background is in `outer`.
+    std::pair<TestCaseInstance, std::vector<Result>> generate() const {
+        ppc::random rng(uint32_t(Ny) * 0x1234567 + uint32_t(Nx) * 0x89 + uint32_t(K));
+        Result base{0, 0, 0, 0, {}, {}};
+        colours(rng, base.inner, base.outer);
+
+        // separated by at least one background pixel, so that no two of them form a rectangle together
+        std::vector<Result> rects;
+        for (int attempt = 0; attempt < 100 * K && (int)rects.size() < K; ++attempt) {
+            Result r = base;
+            r.y0 = rng.get_int32(0, Ny - 1);
+            r.x0 = rng.get_int32(0, Nx - 1);
+            r.y1 = rng.get_int32(r.y0 + 1, std::min(Ny, r.y0 + std::max(1, Ny / 2)));
+            r.x1 = rng.get_int32(r.x0 + 1, std::min(Nx, r.x0 + std::max(1, Nx / 2)));
+            bool separated = true;
+            for (const Result &o : rects) {
+                if (r.y0 <= o.y1 && o.y0 <= r.y1 && r.x0 <= o.x1 && o.x0 <= r.x1) {
+                    separated = false;
+                }
+            }
+            if (!separated) {
+                continue;
+            }
+            do {
+                colours(rng, r.inner, r.outer);
+            } while (std::max({std::abs(r.inner[0] - base.outer[0]), std::abs(r.inner[1] - base.outer[1]),
+                               std::abs(r.inner[2] - base.outer[2])}) < MINDIFF);
+            for (int c = 0; c < 3; ++c) {
+                r.outer[c] = base.outer[c];
+            }
+            rects.push_back(r);
+        }
+
+        std::vector<float> data(3 * Ny * Nx);
+        for (int y = 0; y < Ny; ++y) {
+            for (int x = 0; x < Nx; ++x) {
+                const float *color = base.outer;
+                for (const Result &r : rects) {
+                    if (is_inside(r, y, x)) {
+                        color = r.inner;
+                    }
+                }
+                for (int c = 0; c < 3; ++c) {
+                    data[c + 3 * x + 3 * Nx * y] = color[c];
+                }
+            }
+        }
+        return {{Ny, Nx, std::move(data), base}, rects};
+    }
+
+  private:
+    int Ny, Nx, K;
+};
+
 // A monochromatic image with a rectangle on it. The rectangle consists of one part in a single color, and one part following a gradient.
 // In this case, we can relatively easily try out all candidate rectangles to find the solution.
 class GradientTestCase : public ISTestCase {
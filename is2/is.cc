@@ -1,19 +1,16 @@
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <numeric>
 #include <stdio.h>
 #include <vector>
 
-struct Result {
-  int y0;
-  int x0;
-  int y1;
-  int x1;
-  float outer[3];
-  float inner[3];
-};
+#include "is.h"
 
 typedef double pixel __attribute__((vector_size(4 * sizeof(double))));
+typedef double double4_t __attribute__((vector_size(4 * sizeof(double))));
 
 constexpr pixel d40{0.0, 0.0, 0.0, 0.0};
 
@@ -27,105 +24,681 @@ This is the function you need to implement. Quick reference:
 
 using namespace std;
 
-Result segment(int ny, int nx, const float *data) {
+#ifdef PPC_STATS
+SegmentStats segment_stats;
+
+static long long stats_clock() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+#define STATS(x) x
+#else
+#define STATS(x)
+#endif
+
+namespace {
+
+struct Candidate {
+  double score;
+  int y0, x0, y1, x1;
+};
+
+} // namespace
+
+// sum of the rectangle [y0, y1) x [x0, x1) from a padded integral image
+static inline pixel rect_sum(const vector<pixel> &sums, int nx, int y0, int x0,
+                             int y1, int x1) {
+  return sums[x1 + (nx + 1) * y1] - sums[x0 + (nx + 1) * y1] -
+         sums[x1 + (nx + 1) * y0] + sums[x0 + (nx + 1) * y0];
+}
+
+// the quantity to maximise: the cost is the sum of squares minus this
+static inline double rect_score(pixel inner_sum, pixel total, double pixel_x,
+                                double pixel_y) {
+  pixel outer_sum = total - inner_sum;
+  pixel best4 =
+      inner_sum * inner_sum * pixel_x + outer_sum * outer_sum * pixel_y;
+  return best4[0] + best4[1] + best4[2];
+}
+
+static Result make_result(const vector<pixel> &sums, int ny, int nx, int y0,
+                          int x0, int y1, int x1) {
   int image_size = nx * ny;
-  vector<pixel> image_padded((nx + 1) * (ny + 1));
-  vector<pixel> image(image_size);
-  // fill with zero
-  fill(image_padded.begin(), image_padded.end(), d40);
-  fill(image.begin(), image.end(), d40);
+  double pixel_x = (y1 - y0) * (x1 - x0);
+  double pixel_y = image_size - pixel_x;
+  pixel_x = 1 / pixel_x;
+  pixel_y = 1 / pixel_y;
+  pixel channel_x_sum = rect_sum(sums, nx, y0, x0, y1, x1);
+  pixel channel_y_sum = sums[nx + (nx + 1) * ny] - channel_x_sum;
+  channel_y_sum *= pixel_y;
+  channel_x_sum *= pixel_x;
 
-  double optimal = -1;
+  Result result{y0,
+                x0,
+                y1,
+                x1,
+                {static_cast<float>(channel_y_sum[0]),
+                 static_cast<float>(channel_y_sum[1]),
+                 static_cast<float>(channel_y_sum[2])},
+                {static_cast<float>(channel_x_sum[0]),
+                 static_cast<float>(channel_x_sum[1]),
+                 static_cast<float>(channel_x_sum[2])}};
+  return result;
+}
 
-  int x0_ret = 0, y0_ret = 0, x1_ret = 0, y1_ret = 0;
+/*
+Padded integral images of the colour values, and optionally of their positive
+parts, built straight from the interleaved input. The first row and column of
+the output are left as they are (zero). Rows are prefix-summed independently
+into their final slots, and then accumulated downwards with the columns split
+between threads, so the input is read once and nothing else is allocated.
+*/
+static void integral_image(int ny, int nx, const float *data,
+                           vector<pixel> &sums,
+                           vector<pixel> *pos_sums = nullptr) {
+  const int stride = nx + 1;
 
-  // fill image vector
+#pragma omp parallel for schedule(static)
   for (int row = 0; row < ny; row++) {
+    const float *in = data + 3 * nx * row;
+    pixel *out = &sums[1 + stride * (row + 1)];
+    pixel *pos_out = pos_sums ? &(*pos_sums)[1 + stride * (row + 1)] : nullptr;
+    pixel row_sum = d40, row_pos = d40;
     for (int col = 0; col < nx; col++) {
-      for (int c = 0; c < 3; c++) {
-        image[col + nx * row][c] =
-            static_cast<double>(data[c + 3 * (col + nx * row)]);
+      pixel v{in[3 * col], in[3 * col + 1], in[3 * col + 2], 0.0};
+      row_sum += v;
+      out[col] = row_sum;
+      if (pos_out) {
+        row_pos += v > 0 ? v : d40;
+        pos_out[col] = row_pos;
       }
     }
   }
 
-  for (int row = 0; row < ny; row++) {
-    for (int col = 0; col < nx; col++) {
-      image_padded[(col + 1) + (nx + 1) * (row + 1)] =
-          image[col + nx * row] + image_padded[col + (nx + 1) * (row + 1)] +
-          image_padded[(col + 1) + (nx + 1) * row] -
-          image_padded[col + (nx + 1) * row];
+  // about 2 kB of each row per block
+  constexpr int block = 64;
+  const int nblocks = (nx + block - 1) / block;
+#pragma omp parallel for schedule(static)
+  for (int b = 0; b < nblocks; b++) {
+    const int col0 = 1 + b * block, col1 = min(nx + 1, col0 + block);
+    for (int row = 2; row <= ny; row++) {
+      pixel *prev = &sums[stride * (row - 1)], *cur = &sums[stride * row];
+      for (int col = col0; col < col1; col++) {
+        cur[col] += prev[col];
+      }
+      if (pos_sums) {
+        prev = &(*pos_sums)[stride * (row - 1)];
+        cur = &(*pos_sums)[stride * row];
+        for (int col = col0; col < col1; col++) {
+          cur[col] += prev[col];
+        }
+      }
     }
   }
+}
 
+// Tries all candidates, grouped by size: the outer loops fix the height and
+// the width, so the areas are known in the inner loops.
+static Candidate scan_by_size(const vector<pixel> &image_padded, int ny,
+                              int nx) {
+  int image_size = nx * ny;
   pixel image_flat = image_padded[nx + (nx + 1) * ny];
 
-// inner
-  double inner_optimal = -1;
-  int x0_inner = 0, y0_inner = 0, x1_inner = 0, y1_inner = 0;
+  Candidate best{-1, 0, 0, 0, 0};
   for (int height = 1; height <= ny; height++) {
     for (int width = 1; width <= nx; width++) {
       double pixel_x = height * width;
       double pixel_y = image_size - pixel_x;
       pixel_x = 1 / pixel_x;
       pixel_y = 1 / pixel_y;
+      STATS(segment_stats.candidates +=
+            (long long)(ny - height + 1) * (nx - width + 1));
       for (int y0 = 0; y0 <= ny - height; y0++) {
         for (int x0 = 0; x0 <= nx - width; x0++) {
           int y1 = y0 + height;
           int x1 = x0 + width;
-          double best = 0;
-          pixel channel_x_sum = image_padded[x1 + (nx + 1) * y1] -
-                                  image_padded[x0 + (nx + 1) * y1] -
-                                  image_padded[x1 + (nx + 1) * y0] +
-                                  image_padded[x0 + (nx + 1) * y0];
-          pixel channel_y_sum = image_flat - channel_x_sum;
-          pixel best4 = channel_x_sum * channel_x_sum * pixel_x +
-                        channel_y_sum * channel_y_sum * pixel_y;
-          best = best4[0] + best4[1] + best4[2];
-          if (best > inner_optimal) {
-            inner_optimal = best;
-            y0_inner = y0;
-            x0_inner = x0;
-            y1_inner = y1;
-            x1_inner = x1;
+          pixel channel_x_sum =
+              rect_sum(image_padded, nx, y0, x0, y1, x1);
+          double score = rect_score(channel_x_sum, image_flat, pixel_x, pixel_y);
+          if (score > best.score) {
+            best = {score, y0, x0, y1, x1};
           }
         }
       }
     }
   }
+  return best;
+}
+
+static inline double4_t load4(const double *p) {
+  double4_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/*
+Tries all candidates, grouped by rows: for a fixed pair y0 < y1 the rows in
+between are reduced to a one-dimensional prefix array over x, one array per
+colour component. Each strip fits in L1, every x-interval of it is one
+subtraction, and the widths of a fixed x0 are scored four at a time with
+contiguous loads. Each SIMD lane keeps its own best candidate, and the row
+pairs are split between threads.
+*/
+static Candidate scan_by_strips(const vector<pixel> &sums, int ny, int nx) {
+  const int image_size = nx * ny;
+  const pixel total = sums[nx + (nx + 1) * ny];
+  // room for reading a full vector past the end
+  const int len = nx + 4;
+
+  Candidate best{-1, 0, 0, 0, 0};
+#pragma omp parallel
   {
-    if (inner_optimal > optimal) {
-      optimal = inner_optimal;
-      y0_ret = y0_inner;
-      x0_ret = x0_inner;
-      y1_ret = y1_inner;
-      x1_ret = x1_inner;
+    vector<double> strip(3 * len, 0.0), inv_in(len, 0.0), inv_out(len, 0.0);
+    double *strip_c[3] = {&strip[0], &strip[len], &strip[2 * len]};
+    Candidate local{-1, 0, 0, 0, 0};
+    STATS(long long candidates = 0);
+
+#pragma omp for collapse(2) schedule(dynamic, 16) nowait
+    for (int y0 = 0; y0 < ny; y0++) {
+      for (int y1 = 1; y1 <= ny; y1++) {
+        if (y1 <= y0) {
+          continue;
+        }
+        const int height = y1 - y0;
+        // the whole image is not a candidate
+        const int max_width = height == ny ? nx - 1 : nx;
+        for (int x = 0; x <= nx; x++) {
+          pixel v = sums[x + (nx + 1) * y1] - sums[x + (nx + 1) * y0];
+          for (int c = 0; c < 3; c++) {
+            strip_c[c][x] = v[c];
+          }
+        }
+        for (int width = 1; width <= max_width; width++) {
+          inv_in[width] = 1.0 / (height * width);
+          inv_out[width] = 1.0 / (image_size - height * width);
+        }
+
+        double4_t best_score = {-1, -1, -1, -1}, best_x0 = {}, best_width = {};
+        for (int x0 = 0; x0 < nx; x0++) {
+          const int widths = min(max_width, nx - x0);
+          STATS(candidates += widths);
+          const double4_t x0v = {double(x0), double(x0), double(x0),
+                                 double(x0)};
+          for (int width = 1; width <= widths; width += 4) {
+            double4_t score = {};
+            for (int c = 0; c < 3; c++) {
+              double4_t inner = load4(&strip_c[c][x0 + width]) - strip_c[c][x0];
+              double4_t outer = total[c] - inner;
+              score += inner * inner * load4(&inv_in[width]) +
+                       outer * outer * load4(&inv_out[width]);
+            }
+            double4_t widthv = {double(width), double(width + 1),
+                                double(width + 2), double(width + 3)};
+            if (width + 3 > widths) {
+              score = widthv <= widths ? score : double4_t{} - 1;
+            }
+            auto better = score > best_score;
+            best_score = better ? score : best_score;
+            best_x0 = better ? x0v : best_x0;
+            best_width = better ? widthv : best_width;
+          }
+        }
+
+        for (int lane = 0; lane < 4; lane++) {
+          if (best_score[lane] > local.score) {
+            int x0 = best_x0[lane];
+            local = {best_score[lane], y0, x0, y1, x0 + int(best_width[lane])};
+          }
+        }
+      }
+    }
+#pragma omp critical
+    {
+      if (local.score > best.score) {
+        best = local;
+      }
+      STATS(segment_stats.candidates += candidates);
     }
   }
+  return best;
+}
 
-  double pixel_x = (y1_ret - y0_ret) * (x1_ret - x0_ret);
-  double pixel_y = image_size - pixel_x;
-  pixel_x = 1 / pixel_x;
-  pixel_y = 1 / pixel_y;
-  pixel channel_x_sum, channel_y_sum;
-  channel_x_sum = image_padded[x1_ret + (nx + 1) * y1_ret] -
-                    image_padded[x0_ret + (nx + 1) * y1_ret] -
-                    image_padded[x1_ret + (nx + 1) * y0_ret] +
-                    image_padded[x0_ret + (nx + 1) * y0_ret];
-  channel_y_sum = image_flat - channel_x_sum;
-  channel_y_sum *= pixel_y;
-  channel_x_sum *= pixel_x;
+// below this width the strips are too short to pay off
+constexpr int STRIP_MIN_WIDTH = 8;
 
-  Result result{y0_ret,
-                x0_ret,
-                y1_ret,
-                x1_ret,
-                {static_cast<float>(channel_y_sum[0]),
-                 static_cast<float>(channel_y_sum[1]),
-                 static_cast<float>(channel_y_sum[2])},
-                {static_cast<float>(channel_x_sum[0]),
-                 static_cast<float>(channel_x_sum[1]),
-                 static_cast<float>(channel_x_sum[2])}};
+Result segment(int ny, int nx, const float *data) {
+  STATS(long long t0 = stats_clock());
+  vector<pixel> image_padded((nx + 1) * (ny + 1), d40);
+  integral_image(ny, nx, data, image_padded);
+  STATS(long long t1 = stats_clock(); segment_stats.setup_ns += t1 - t0);
+
+  Candidate best = nx >= STRIP_MIN_WIDTH ? scan_by_strips(image_padded, ny, nx)
+                                         : scan_by_size(image_padded, ny, nx);
+  STATS(long long t2 = stats_clock(); segment_stats.search_ns += t2 - t1);
+
+  Result result =
+      make_result(image_padded, ny, nx, best.y0, best.x0, best.y1, best.x1);
+  STATS(segment_stats.colour_ns += stats_clock() - t2);
+  return result;
+}
+
+/*
+Streaming segmentation, as an exact branch-and-bound search. A box is a set of
+candidates given by an interval for each of y0, y1, x0 and x1. The score of
+every candidate in a box is bounded from above using the smallest and the
+largest rectangle of the box: the score is jointly convex in the inner sum
+and the inner area, so over the box it is at most its maximum at the four
+combinations of extreme areas and extreme inner sums, and the extreme sums
+follow from the sums of the positive and negative parts of the ring between
+the smallest and the largest rectangle.
+
+Boxes are expanded best-first by splitting their widest interval, small
+boxes are scanned exhaustively, and the search stops once no box can beat
+the best candidate found so far. The previous frame's optimum, rescored on
+the new frame, is the initial best candidate, so for slowly changing video
+almost everything is ruled out right away.
+*/
+
+struct Segmenter::State {
+  int ny, nx;
+  // padded integral images of the values and of their positive parts
+  vector<pixel> sums, pos_sums;
+  // integral image of the previous frame
+  vector<pixel> prev_sums;
+  bool has_prev = false;
+  Result prev;
+};
+
+Segmenter::Segmenter(int ny, int nx) : state(new State) {
+  state->ny = ny;
+  state->nx = nx;
+  state->sums.resize((nx + 1) * (ny + 1), d40);
+  state->pos_sums.resize((nx + 1) * (ny + 1), d40);
+  state->prev_sums.resize((nx + 1) * (ny + 1), d40);
+}
+
+Segmenter::~Segmenter() = default;
+
+namespace {
+
+// y0 in [y0[0], y0[1]], y1 in [y1[0], y1[1]], and the same for x
+struct Box {
+  double bound;
+  int y0[2], y1[2], x0[2], x1[2];
+
+  bool operator<(const Box &other) const { return bound < other.bound; }
+};
+
+// boxes with at most this many candidates are scanned instead of split
+constexpr long long SCAN_LIMIT = 64;
+
+inline long long box_count(const Box &b) {
+  return (long long)(b.y0[1] - b.y0[0] + 1) * (b.y1[1] - b.y1[0] + 1) *
+         (b.x0[1] - b.x0[0] + 1) * (b.x1[1] - b.x1[0] + 1);
+}
+
+// A line s = c + k * a in the (inner area, inner sum) plane.
+struct Line {
+  double c, k;
+  double at(double a) const { return c + k * a; }
+};
 
+// Upper bound of s^2 / a + (t - s)^2 / (n - a) over a in [a_min, a_max] and
+// max(lower) <= s <= min(upper). The function is convex, so its maximum over
+// this polygon is attained on the boundary, at a breakpoint of one of the
+// two envelopes or at an end of the interval.
+inline double channel_bound(const Line (&upper)[3], const Line (&lower)[3],
+                            double t, double a_min, double a_max, double n) {
+  double as[8] = {a_min, a_max};
+  int count = 2;
+  for (const Line(*lines)[3] : {&upper, &lower}) {
+    for (int i = 0; i < 3; i++) {
+      for (int j = i + 1; j < 3; j++) {
+        const Line &p = (*lines)[i], &q = (*lines)[j];
+        if (p.k != q.k) {
+          double a = (q.c - p.c) / (p.k - q.k);
+          if (a_min < a && a < a_max) {
+            as[count++] = a;
+          }
+        }
+      }
+    }
+  }
+  double best = 0;
+  for (int i = 0; i < count; i++) {
+    double a = as[i];
+    double hi = min({upper[0].at(a), upper[1].at(a), upper[2].at(a)});
+    double lo = max({lower[0].at(a), lower[1].at(a), lower[2].at(a)});
+    for (double v : {hi, lo}) {
+      best = max(best, v * v / a + (t - v) * (t - v) / (n - a));
+    }
+  }
+  return best;
+}
+
+} // namespace
+
+Result Segmenter::next(const float *data) {
+  State &s = *state;
+  const int ny = s.ny, nx = s.nx;
+  const int image_size = ny * nx;
+
+  STATS(long long t0 = stats_clock());
+  swap(s.sums, s.prev_sums);
+  integral_image(ny, nx, data, s.sums, &s.pos_sums);
+  STATS(long long t1 = stats_clock(); segment_stats.setup_ns += t1 - t0);
+
+  // an unchanged frame has an unchanged answer
+  if (s.has_prev && equal(s.sums.begin(), s.sums.end(), s.prev_sums.begin(),
+                          [](pixel a, pixel b) {
+                            return a[0] == b[0] && a[1] == b[1] &&
+                                   a[2] == b[2];
+                          })) {
+    return s.prev;
+  }
+
+  const pixel total = s.sums[nx + (nx + 1) * ny];
+  auto score_of = [&](int y0, int x0, int y1, int x1) {
+    double pixel_x = (y1 - y0) * (x1 - x0);
+    double pixel_y = image_size - pixel_x;
+    return rect_score(rect_sum(s.sums, nx, y0, x0, y1, x1), total,
+                      1 / pixel_x, 1 / pixel_y);
+  };
+
+  Candidate best{-1, 0, 0, 0, 0};
+  if (s.has_prev) {
+    const Result &p = s.prev;
+    best = {score_of(p.y0, p.x0, p.y1, p.x1), p.y0, p.x0, p.y1, p.x1};
+  }
+
+  // range of the colour values in this frame
+  pixel v_min = d40, v_max = d40;
+  for (int c = 0; c < 3; c++) {
+    v_min[c] = v_max[c] = data[c];
+  }
+  for (int i = 0; i < 3 * image_size; i++) {
+    v_min[i % 3] = min(v_min[i % 3], static_cast<double>(data[i]));
+    v_max[i % 3] = max(v_max[i % 3], static_cast<double>(data[i]));
+  }
+
+  // Every candidate of a box contains its smallest rectangle and is contained
+  // in its largest one. If d pixels of the ring between the two are inside,
+  // their sum is bounded both by d times the extreme values and by the sums of
+  // the positive and negative parts of the ring.
+  auto bound_of = [&](Box &b) {
+    pixel out_sum = rect_sum(s.sums, nx, b.y0[0], b.x0[0], b.y1[1], b.x1[1]);
+    pixel out_pos =
+        rect_sum(s.pos_sums, nx, b.y0[0], b.x0[0], b.y1[1], b.x1[1]);
+    double out_area = (b.y1[1] - b.y0[0]) * (b.x1[1] - b.x0[0]);
+
+    pixel in_sum = d40, in_pos = d40;
+    double in_area = 0;
+    if (b.y0[1] < b.y1[0] && b.x0[1] < b.x1[0]) {
+      in_sum = rect_sum(s.sums, nx, b.y0[1], b.x0[1], b.y1[0], b.x1[0]);
+      in_pos = rect_sum(s.pos_sums, nx, b.y0[1], b.x0[1], b.y1[0], b.x1[0]);
+      in_area = (b.y1[0] - b.y0[1]) * (b.x1[0] - b.x0[1]);
+    }
+
+    double a_max = min(out_area, image_size - 1.0);
+    double a_min = max(b.y1[0] - b.y0[1], 1) * max(b.x1[0] - b.x0[1], 1);
+    a_min = min(a_min, a_max);
+
+    pixel ring_sum = out_sum - in_sum;
+    pixel ring_pos = out_pos - in_pos;
+    pixel ring_neg = ring_sum - ring_pos;
+    double ring_area = out_area - in_area;
+
+    double bound = 0;
+    for (int c = 0; c < 3; c++) {
+      double in = in_sum[c], lo = v_min[c], hi = v_max[c];
+      Line upper[3] = {{in - hi * in_area, hi},
+                       {in + ring_pos[c], 0},
+                       {in + ring_sum[c] - lo * (ring_area + in_area), lo}};
+      Line lower[3] = {{in - lo * in_area, lo},
+                       {in + ring_neg[c], 0},
+                       {in + ring_sum[c] - hi * (ring_area + in_area), hi}};
+      bound += channel_bound(upper, lower, total[c], a_min, a_max, image_size);
+    }
+    b.bound = bound;
+    STATS(segment_stats.bounds++);
+  };
+
+  auto scan = [&](const Box &b) {
+    for (int y0 = b.y0[0]; y0 <= b.y0[1]; y0++) {
+      for (int y1 = max(b.y1[0], y0 + 1); y1 <= b.y1[1]; y1++) {
+        for (int x0 = b.x0[0]; x0 <= b.x0[1]; x0++) {
+          for (int x1 = max(b.x1[0], x0 + 1); x1 <= b.x1[1]; x1++) {
+            if ((y1 - y0) * (x1 - x0) == image_size) {
+              continue;
+            }
+            double score = score_of(y0, x0, y1, x1);
+            STATS(segment_stats.candidates++);
+            if (score > best.score) {
+              best = {score, y0, x0, y1, x1};
+            }
+          }
+        }
+      }
+    }
+  };
+
+  vector<Box> queue;
+  Box root{0, {0, ny - 1}, {1, ny}, {0, nx - 1}, {1, nx}};
+  bound_of(root);
+  queue.push_back(root);
+  while (!queue.empty()) {
+    pop_heap(queue.begin(), queue.end());
+    Box b = queue.back();
+    queue.pop_back();
+    if (b.bound <= best.score) {
+      break;
+    }
+    if (box_count(b) <= SCAN_LIMIT) {
+      scan(b);
+      continue;
+    }
+
+    // split the widest interval in two
+    int *widest = b.y0;
+    for (int *range : {b.y1, b.x0, b.x1}) {
+      if (range[1] - range[0] > widest[1] - widest[0]) {
+        widest = range;
+      }
+    }
+    int mid = (widest[0] + widest[1]) / 2;
+    Box halves[2] = {b, b};
+    (widest == b.y0 ? halves[0].y0 : widest == b.y1 ? halves[0].y1
+                                     : widest == b.x0 ? halves[0].x0
+                                                      : halves[0].x1)[1] = mid;
+    (widest == b.y0 ? halves[1].y0 : widest == b.y1 ? halves[1].y1
+                                     : widest == b.x0 ? halves[1].x0
+                                                      : halves[1].x1)[0] =
+        mid + 1;
+    for (Box &h : halves) {
+      // keep y0 < y1 and x0 < x1 satisfiable
+      h.y1[0] = max(h.y1[0], h.y0[0] + 1);
+      h.y0[1] = min(h.y0[1], h.y1[1] - 1);
+      h.x1[0] = max(h.x1[0], h.x0[0] + 1);
+      h.x0[1] = min(h.x0[1], h.x1[1] - 1);
+      if (h.y0[0] > h.y0[1] || h.y1[0] > h.y1[1] || h.x0[0] > h.x0[1] ||
+          h.x1[0] > h.x1[1]) {
+        continue;
+      }
+      bound_of(h);
+      if (h.bound > best.score) {
+        queue.push_back(h);
+        push_heap(queue.begin(), queue.end());
+      }
+    }
+  }
+
+  STATS(long long t2 = stats_clock(); segment_stats.search_ns += t2 - t1);
+
+  s.prev = make_result(s.sums, ny, nx, best.y0, best.x0, best.y1, best.x1);
+  s.has_prev = true;
+  STATS(segment_stats.colour_ns += stats_clock() - t2);
+  return s.prev;
+}
+
+/*
+k-segment mode. The score of a partition into rectangles R_i and the
+background is the sum of |sum(R)|^2 / area(R) over all parts, and the cost
+is the sum of squares minus the score. Rectangles are added greedily: each
+step cuts the best rectangle out of the free part of the background. Then
+each rectangle in turn is taken out and put back at its best position given
+the others, until no rectangle moves. Every search tries all free candidate
+rectangles, in parallel over their heights.
+*/
+
+namespace {
+
+// best rectangle that contains no taken pixel, when cut out of a background
+// with the given sum and area; its score is its part of the total score
+Candidate best_addition(const vector<pixel> &sums, const vector<int> &taken,
+                        int ny, int nx, pixel bg_sum, int bg_area) {
+  Candidate best{-1, 0, 0, 0, 0};
+#pragma omp parallel
+  {
+    Candidate local{-1, 0, 0, 0, 0};
+#pragma omp for schedule(dynamic, 1) nowait
+    for (int height = 1; height <= ny; height++) {
+      for (int width = 1; width <= nx; width++) {
+        if (height * width >= bg_area) {
+          break;
+        }
+        double pixel_x = 1.0 / (height * width);
+        double pixel_y = 1.0 / (bg_area - height * width);
+        for (int y0 = 0; y0 <= ny - height; y0++) {
+          for (int x0 = 0; x0 <= nx - width; x0++) {
+            int y1 = y0 + height;
+            int x1 = x0 + width;
+            if (taken[x1 + (nx + 1) * y1] - taken[x0 + (nx + 1) * y1] -
+                    taken[x1 + (nx + 1) * y0] + taken[x0 + (nx + 1) * y0] !=
+                0) {
+              continue;
+            }
+            double score = rect_score(rect_sum(sums, nx, y0, x0, y1, x1),
+                                      bg_sum, pixel_x, pixel_y);
+            if (score > local.score) {
+              local = {score, y0, x0, y1, x1};
+            }
+          }
+        }
+      }
+    }
+#pragma omp critical
+    {
+      if (local.score > best.score) {
+        best = local;
+      }
+    }
+  }
+  return best;
+}
+
+// integral image of the pixels covered by the given rectangles, skipping one
+vector<int> taken_pixels(int ny, int nx, const vector<Candidate> &rects,
+                         int skip) {
+  vector<int> taken((nx + 1) * (ny + 1), 0);
+  for (int i = 0; i < (int)rects.size(); i++) {
+    if (i == skip) {
+      continue;
+    }
+    const Candidate &r = rects[i];
+    for (int row = r.y0; row < r.y1; row++) {
+      for (int col = r.x0; col < r.x1; col++) {
+        taken[(col + 1) + (nx + 1) * (row + 1)] = 1;
+      }
+    }
+  }
+  for (int row = 1; row <= ny; row++) {
+    for (int col = 1; col <= nx; col++) {
+      taken[col + (nx + 1) * row] += taken[(col - 1) + (nx + 1) * row] +
+                                     taken[col + (nx + 1) * (row - 1)] -
+                                     taken[(col - 1) + (nx + 1) * (row - 1)];
+    }
+  }
+  return taken;
+}
+
+} // namespace
+
+MultiResult segment_k(int ny, int nx, int k, const float *data) {
+  const int image_size = ny * nx;
+  vector<pixel> sums((nx + 1) * (ny + 1), d40);
+  integral_image(ny, nx, data, sums);
+  const pixel total = sums[nx + (nx + 1) * ny];
+
+  vector<Candidate> rects;
+  pixel bg_sum = total;
+  int bg_area = image_size;
+
+  auto part_score = [](pixel sum, int area) {
+    pixel sq = sum * sum / area;
+    return sq[0] + sq[1] + sq[2];
+  };
+
+  // greedy placement
+  for (int i = 0; i < k; i++) {
+    vector<int> taken = taken_pixels(ny, nx, rects, -1);
+    Candidate c = best_addition(sums, taken, ny, nx, bg_sum, bg_area);
+    if (c.score <= part_score(bg_sum, bg_area)) {
+      break;
+    }
+    rects.push_back(c);
+    bg_sum -= rect_sum(sums, nx, c.y0, c.x0, c.y1, c.x1);
+    bg_area -= (c.y1 - c.y0) * (c.x1 - c.x0);
+  }
+
+  // refinement: move one rectangle at a time to its best position
+  for (bool moved = true; moved;) {
+    moved = false;
+    for (int i = 0; i < (int)rects.size(); i++) {
+      Candidate &r = rects[i];
+      pixel r_sum = rect_sum(sums, nx, r.y0, r.x0, r.y1, r.x1);
+      int r_area = (r.y1 - r.y0) * (r.x1 - r.x0);
+      pixel free_sum = bg_sum + r_sum;
+      int free_area = bg_area + r_area;
+      double current = part_score(r_sum, r_area) +
+                       part_score(bg_sum, bg_area);
+
+      vector<int> taken = taken_pixels(ny, nx, rects, i);
+      Candidate c = best_addition(sums, taken, ny, nx, free_sum, free_area);
+      if (c.score > current * (1 + 1e-12)) {
+        r = c;
+        bg_sum = free_sum - rect_sum(sums, nx, c.y0, c.x0, c.y1, c.x1);
+        bg_area = free_area - (c.y1 - c.y0) * (c.x1 - c.x0);
+        moved = true;
+      }
+    }
+  }
+
+  double sum_sq = 0;
+  for (int i = 0; i < 3 * image_size; i++) {
+    sum_sq += static_cast<double>(data[i]) * data[i];
+  }
+
+  MultiResult result;
+  double score = part_score(bg_sum, bg_area);
+  pixel outer = bg_sum / bg_area;
+  for (int c = 0; c < 3; c++) {
+    result.outer[c] = static_cast<float>(outer[c]);
+  }
+  for (const Candidate &r : rects) {
+    pixel r_sum = rect_sum(sums, nx, r.y0, r.x0, r.y1, r.x1);
+    int r_area = (r.y1 - r.y0) * (r.x1 - r.x0);
+    score += part_score(r_sum, r_area);
+    pixel inner = r_sum / r_area;
+    result.segments.push_back({r.y0,
+                               r.x0,
+                               r.y1,
+                               r.x1,
+                               {static_cast<float>(inner[0]),
+                                static_cast<float>(inner[1]),
+                                static_cast<float>(inner[2])}});
+  }
+  result.cost = max(sum_sq - score, 0.0);
   return result;
-}
\ No newline at end of file
+}
@@ -1,3 +1,16 @@
 #pragma once
 
 void mf(int ny, int nx, int hy, int hx, const float *in, float *out);
+
+#ifdef PPC_STATS
+// Instrumentation of mf, accumulated over calls. Only available when
+// compiled with PPC_STATS.
+struct MedianStats {
+    long long interior_ns;   // pixels whose windows have the full size
+    long long border_ns;     // pixels whose windows are cut by the border
+    long long interior_pixels;
+    long long border_pixels;
+};
+
+extern MedianStats median_stats;
+#endif
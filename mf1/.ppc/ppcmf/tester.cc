@@ -93,6 +93,16 @@ static bool verify(const input &input, float *output, int *errors) {
     return pass;
 }
 
+#ifdef PPC_STATS
+static void print_stats(ppc::fdostream &stream) {
+    stream
+        << "perf_mf_interior_ns\t" << median_stats.interior_ns << '\n'
+        << "perf_mf_border_ns\t" << median_stats.border_ns << '\n'
+        << "perf_mf_interior_pixels\t" << median_stats.interior_pixels << '\n'
+        << "perf_mf_border_pixels\t" << median_stats.border_pixels << '\n';
+}
+#endif
+
 int main(int argc, const char **argv) {
     const char *ppc_output = std::getenv("PPC_OUTPUT");
     int ppc_output_fd = 0;
@@ -146,10 +156,16 @@ int main(int argc, const char **argv) {
 
     ppc::setup_cuda_device();
     ppc::perf timer;
+#ifdef PPC_STATS
+    median_stats = {};
+#endif
     timer.start();
     mf(input.ny, input.nx, input.hy, input.hx, input.input.data(), output.data());
     timer.stop();
     timer.print_to(*stream);
+#ifdef PPC_STATS
+    print_stats(*stream);
+#endif
     ppc::reset_cuda_device();
 
     if (test) {
@@ -8,40 +8,137 @@ This is the function you need to implement. Quick reference:
   in out[x + y*nx].
 */
 
+#include "mf.h"
 #include <vector>
 #include <algorithm>
+#include <chrono>
 #include <numeric>
 
-void mf(int ny, int nx, int hy, int hx, const float* in, float* out) {
-    for (auto row = 0; row < ny; row++)
+#ifdef PPC_STATS
+MedianStats median_stats;
+
+static long long stats_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+#define STATS(x) x
+#else
+#define STATS(x)
+#endif
+
+// median of window[0 .. n), reordering it
+static float median_of(float* window, int n) {
+    int middle_n = n / 2;
+    std::nth_element(window, window + middle_n, window + n);
+    if (n % 2 == 1) {
+        return window[middle_n];
+    }
+    // the other middle value is the largest of the lower half
+    float lower = *std::max_element(window, window + middle_n);
+    return static_cast<float>((double(window[middle_n]) + lower) / 2.0);
+}
+
+// next = sorted with the values of gone removed and those of added inserted;
+// all three are sorted, and gone and added both have m values
+static void slide(const float* sorted, int n, const float* gone, const float* added, int m, float* next) {
+    int g = 0, a = 0, k = 0;
+    for (auto i = 0; i < n; i++) {
+        float v = sorted[i];
+        if (g < m && v == gone[g]) {
+            g++;
+            continue;
+        }
+        while (a < m && added[a] < v) {
+            next[k++] = added[a++];
+        }
+        next[k++] = v;
+    }
+    while (a < m) {
+        next[k++] = added[a++];
+    }
+}
+
+// Interior pixels: rows [hy, ny-hy) and columns [hx, nx-hx), whose windows
+// have exactly (2*hy+1) * (2*hx+1) pixels, so there are no bounds checks and
+// the window size is always odd. Along a row the window is kept sorted: one
+// step right removes the sorted leftmost column and merges in the sorted new
+// column, which is linear in the window size.
+static void mf_interior(int ny, int nx, int hy, int hx, const float* in, float* out) {
+    const int w = 2*hx + 1, h = 2*hy + 1;
+    const int n = h * w;
+    if (w > nx) {
+        return;
+    }
+    std::vector<float> sorted(n), next(n), gone(h), added(h);
+    for (auto row = hy; row < ny - hy; row++)
     {
-        for (auto col = 0; col < nx; col++)
-        {   
-            std::vector<double> window;
-            window.reserve((2*hx + 1) * (2*hy + 1));
-
-            for (auto window_row = std::max(0, row - hy); window_row < std::min(row + hy + 1, ny); window_row++) {
-              for (auto window_col = std::max(0, col - hx); window_col < std::min(col + hx + 1, nx); window_col++) {
-                window.push_back(in[window_col + nx * window_row]);
-              }
-            }
+        const float* top = in + nx * (row - hy);
+        for (auto j = 0; j < h; j++) {
+          std::copy(top + nx * j, top + nx * j + w, sorted.begin() + w * j);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        out[hx + nx * row] = sorted[n / 2];
 
-            size_t window_size = window.size();
-            size_t middle_n;
-
-            if (window_size % 2 == 1) {
-              middle_n = (window_size - 1) / 2;
-              std::nth_element(window.begin(), window.begin() + middle_n, window.end());
-              out[col + nx * row] = static_cast<float>(window[middle_n]);
-            } else {
-              middle_n = window_size / 2;
-              std::nth_element(window.begin(), window.begin() + middle_n-1, window.end());
-              std::nth_element(window.begin(), window.begin() + middle_n, window.end());
-              // std::sort(window.begin(), window.end());
-              // out[col + nx * row] = static_cast<float>((window[middle_n] + window[middle_n-1]) / 2.0);
+        for (auto col = hx + 1; col < nx - hx; col++)
+        {
+            for (auto j = 0; j < h; j++) {
+              gone[j] = top[(col - hx - 1) + nx * j];
+              added[j] = top[(col + hx) + nx * j];
             }
+            std::sort(gone.begin(), gone.end());
+            std::sort(added.begin(), added.end());
+            slide(sorted.data(), n, gone.data(), added.data(), h, next.data());
+            sorted.swap(next);
+            out[col + nx * row] = sorted[n / 2];
+        }
+    }
+}
 
-            window.clear();
+// one pixel whose window is cut by the image border
+static void mf_border_pixel(int ny, int nx, int hy, int hx, const float* in, float* out, float* window,
+                            int row, int col) {
+    int window_size = 0;
+    for (auto window_row = std::max(0, row - hy); window_row < std::min(row + hy + 1, ny); window_row++) {
+      for (auto window_col = std::max(0, col - hx); window_col < std::min(col + hx + 1, nx); window_col++) {
+        window[window_size++] = in[window_col + nx * window_row];
+      }
+    }
+    out[col + nx * row] = median_of(window, window_size);
+}
+
+// Border pixels: the top and bottom hy rows, and the first and last hx
+// columns of the rows in between.
+static void mf_border(int ny, int nx, int hy, int hx, const float* in, float* out, float* window) {
+    const bool has_interior = 2*hy < ny && 2*hx < nx;
+    for (auto row = 0; row < ny; row++)
+    {
+        if (has_interior && hy <= row && row < ny - hy) {
+            for (auto col = 0; col < hx; col++) {
+              mf_border_pixel(ny, nx, hy, hx, in, out, window, row, col);
+            }
+            for (auto col = nx - hx; col < nx; col++) {
+              mf_border_pixel(ny, nx, hy, hx, in, out, window, row, col);
+            }
+            STATS(median_stats.border_pixels += 2 * hx);
+        } else {
+            for (auto col = 0; col < nx; col++) {
+              mf_border_pixel(ny, nx, hy, hx, in, out, window, row, col);
+            }
+            STATS(median_stats.border_pixels += nx);
         }
     }
-}
\ No newline at end of file
+}
+
+void mf(int ny, int nx, int hy, int hx, const float* in, float* out) {
+    // one window buffer for all border pixels
+    std::vector<float> window((2*hx + 1) * (2*hy + 1));
+
+    STATS(long long t0 = stats_clock());
+    mf_interior(ny, nx, hy, hx, in, out);
+    STATS(long long t1 = stats_clock(); median_stats.interior_ns += t1 - t0);
+    STATS(median_stats.interior_pixels += (long long)std::max(0, ny - 2*hy) * std::max(0, nx - 2*hx));
+    mf_border(ny, nx, hy, hx, in, out, window.data());
+    STATS(median_stats.border_ns += stats_clock() - t1);
+}
@@ -102,7 +102,7 @@ class Compiler:
             args = self.compile_command(out_file)
             logged = log_command(args)
             result = subprocess.run(args,
-                                    timeout=10,
+                                    timeout=120,
                                     stdout=subprocess.PIPE,
                                     stderr=subprocess.PIPE,
                                     encoding='utf-8',
@@ -129,7 +129,7 @@ class Compiler:
             log_command(args, 2)
             return subprocess.run(args,
                                   input='',
-                                  timeout=10,
+                                  timeout=120,
                                   stdout=subprocess.PIPE,
                                   stderr=subprocess.PIPE,
                                   encoding='utf-8',
@@ -196,7 +196,7 @@ class GccCompiler(Compiler):
                 ]
                 log_command(args, 2)
                 assert (subprocess.run(args,
-                                       timeout=10,
+                                       timeout=120,
                                        input="int main() { } ",
                                        text=True,
                                        stdout=subprocess.PIPE,
@@ -206,7 +206,7 @@ class GccCompiler(Compiler):
             log_command(args, 2)
             output = subprocess.run(args,
                                     input='',
-                                    timeout=10,
+                                    timeout=120,
                                     stdout=subprocess.PIPE,
                                     stderr=subprocess.PIPE,
                                     encoding='utf-8',
@@ -284,7 +284,7 @@ class ClangCompiler(Compiler):
             log_command(args, 2)
             output = subprocess.run(args,
                                     input='',
-                                    timeout=10,
+                                    timeout=120,
                                     stdout=subprocess.PIPE,
                                     stderr=subprocess.PIPE,
                                     encoding='utf-8',
@@ -327,7 +327,7 @@ class ClangCompiler(Compiler):
                 brew_dir_command = ['brew', '--prefix']
                 log_command(brew_dir_command)
                 brew_dir = subprocess.run(brew_dir_command,
-                                          timeout=10,
+                                          timeout=120,
                                           stdout=subprocess.PIPE,
                                           stderr=subprocess.PIPE,
                                           encoding='utf-8').stdout.strip()
@@ -358,7 +358,7 @@ I should be able to find the right packages and compilers then!'''
                 brew_libomp_command = ['brew', 'list', 'libomp']
                 log_command(brew_libomp_command)
                 assert (subprocess.run(brew_libomp_command,
-                                       timeout=10,
+                                       timeout=120,
                                        stdout=subprocess.PIPE,
                                        stderr=subprocess.PIPE).returncode == 0)
             except subprocess.TimeoutExpired:
@@ -476,7 +476,7 @@ def find_nvcc_compiler():
             log_command([program], 2)
             output = subprocess.run([program],
                                     input='',
-                                    timeout=10,
+                                    timeout=120,
                                     stdout=subprocess.PIPE,
                                     stderr=subprocess.PIPE,
                                     encoding='utf-8',
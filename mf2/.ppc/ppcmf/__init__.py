@@ -1,6 +1,7 @@
 import os
 from typing import Optional
 import ppcgrader.config
+from ppcgrader.compiler import Compiler
 
 
 class Config(ppcgrader.config.Config):
@@ -13,6 +14,13 @@ class Config(ppcgrader.config.Config):
         self.demo_flags = self._demo_flags_png
         self.demo_post = self._demo_post_png
 
+    def common_flags(self, compiler: Compiler) -> Compiler:
+        compiler = super().common_flags(compiler)
+        # PPC_STATS=1 enables the instrumentation of mf, reported as extra perf_mf_* statistics
+        if os.environ.get('PPC_STATS'):
+            compiler = compiler.add_definition('PPC_STATS')
+        return compiler
+
     def parse_output(self, output):
         input_data = {
             "nx": None,
@@ -1,3 +1,75 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+
 void mf(int ny, int nx, int hy, int hx, const float *in, float *out);
+
+// Median filter of an interleaved image with `channels` values per pixel;
+// every channel is filtered independently. For even windows, integer
+// results are the average of the two middle values rounded down.
+void mf(int ny, int nx, int channels, int hy, int hx, const uint8_t *in, uint8_t *out);
+void mf(int ny, int nx, int channels, int hy, int hx, const uint16_t *in, uint16_t *out);
+void mf(int ny, int nx, int channels, int hy, int hx, const float *in, float *out);
+
+// Approximate median filter for previews: the input is quantised to 2^bits
+// levels between its minimum and maximum (bits is 8 or 12) and the result
+// is the centre of the level of the median. Returns the largest possible
+// deviation of any output pixel from the exact median: half a level, up to
+// float rounding of the output.
+float mf_approx(int ny, int nx, int hy, int hx, int bits, const float *in, float *out);
+
+// Streaming median filter for images that do not fit in memory. read(y, rows,
+// data) must store image rows [y, y + rows) in data; write(y, rows, data)
+// receives finished output rows [y, y + rows). Rows are read and written in
+// order, and only O(nx * hy) values are held at a time.
+typedef std::function<void(int y, int rows, float *data)> mf_reader;
+typedef std::function<void(int y, int rows, const float *data)> mf_writer;
+
+void mf_stream(int ny, int nx, int hy, int hx, const mf_reader &read, const mf_writer &write);
+
+// mf_stream between raw float files of ny * nx values, through memory maps.
+// Returns false if a file cannot be opened, mapped or written.
+bool mf_file(int ny, int nx, int hy, int hx, const char *in_path, const char *out_path);
+
+// Rank-order filters. A query asks for one value of every window: the
+// quantile q of its values (0 is the minimum, 1 the maximum, 0.5 the median),
+// interpolating linearly between neighbouring ranks, or the mean of the
+// values left after dropping the fraction q of the smallest and of the
+// largest ones, where q is clamped to [0, 0.5) so that at least one value
+// is left. All queries share one pass over the image, and out[i] receives
+// the image of queries[i].
+struct rank_query {
+    enum kind_t { quantile, trimmed_mean } kind;
+    float q;
+};
+
+void rank_filter(int ny, int nx, int hy, int hx, int count, const rank_query *queries, const float *in,
+                 float *const *out);
+
+// Backends of mf, in the order of the small windows they are best for.
+enum class mf_backend { small, select, bitset, histogram };
+
+// The backend mf uses for these dimensions, the one with the smallest time
+// predicted by a cost model. The model is calibrated by a microbenchmark:
+// if the environment variable PPC_MF_CALIBRATION names a file, the
+// calibration is read from it, or measured and written there if missing.
+mf_backend mf_choose_backend(int ny, int nx, int hy, int hx);
+
+// Runs the calibration microbenchmark and writes the result to path.
+bool mf_calibrate(const char *path);
+
+#ifdef PPC_STATS
+// Instrumentation of mf, accumulated over calls. Only available when
+// compiled with PPC_STATS.
+struct MedianStats {
+    int backend;             // mf_backend of the last call
+    long long predicted_ns;  // time predicted by the cost model
+    long long interior_ns;   // pixels whose windows have the full size
+    long long border_ns;     // pixels whose windows are cut by the border
+    long long interior_pixels;
+    long long border_pixels;
+};
+
+extern MedianStats median_stats;
+#endif
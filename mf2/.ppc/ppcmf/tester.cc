@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -19,7 +20,8 @@
 
 const uint64_t FULL_TEST_SIZE = 1'000'000'000;
 
-static bool verify_pixel(int y, int x, const input &input, const float *output) {
+// For integer images, the mean of the two middle values is rounded down.
+static bool verify_pixel(int y, int x, const input &input, const float *output, bool integer = false) {
     int smallcnt = 0;
     int bigcnt = 0;
     int equalcnt = 0;
@@ -61,17 +63,41 @@ static bool verify_pixel(int y, int x, const input &input, const float *output)
         return false;
     }
     // even counts: compute and check mean
+    if (integer) {
+        return std::floor((big + small) * 0.5f) == median;
+    }
     return (big + small) * 0.5f == median;
 }
 
-static bool verify(const input &input, float *output, int *errors) {
+// Relaxed check of mf_approx: within `bound` of the exact median.
+static bool verify_pixel_approx(int y, int x, const input &input, const float *output, float bound) {
+    std::vector<float> window;
+    for (int j = std::max(0, y - input.hy); j < std::min(input.ny, y + input.hy + 1); j++) {
+        for (int i = std::max(0, x - input.hx); i < std::min(input.nx, x + input.hx + 1); i++) {
+            window.push_back(input.input[i + input.nx * j]);
+        }
+    }
+    int k = window.size() / 2;
+    std::nth_element(window.begin(), window.begin() + k, window.end());
+    float median = window[k];
+    if (window.size() % 2 == 0) {
+        median = (median + *std::max_element(window.begin(), window.begin() + k)) * 0.5f;
+    }
+    // allow for float rounding of the output
+    float tolerance = bound + std::numeric_limits<float>::epsilon() * (1 + std::fabs(median));
+    return std::fabs(output[x + input.nx * y] - median) <= tolerance;
+}
+
+// With bound >= 0, pixels are checked with verify_pixel_approx instead.
+static bool verify(const input &input, float *output, int *errors, bool integer = false, float bound = -1) {
     uint64_t operation_count = uint64_t(input.ny) * input.nx * (2 * input.hy + 1) * (2 * input.hx + 1);
     bool pass = true;
 
     if (operation_count <= FULL_TEST_SIZE) {
         for (int y = 0; y < input.ny; y++) {
             for (int x = 0; x < input.nx; x++) {
-                bool p = verify_pixel(y, x, input, output);
+                bool p = bound < 0 ? verify_pixel(y, x, input, output, integer)
+                                   : verify_pixel_approx(y, x, input, output, bound);
                 if (!p) {
                     errors[x + input.nx * y] = 1;
                     pass = false;
@@ -83,7 +109,8 @@ static bool verify(const input &input, float *output, int *errors) {
         for (uint64_t i = 0; i < FULL_TEST_SIZE; i += (2 * input.hy + 1) * (2 * input.hx + 1)) {
             int y = rng.get_int32(0, input.ny - 1);
             int x = rng.get_int32(0, input.nx - 1);
-            bool p = verify_pixel(y, x, input, output);
+            bool p = bound < 0 ? verify_pixel(y, x, input, output, integer)
+                               : verify_pixel_approx(y, x, input, output, bound);
             if (!p) {
                 errors[x + input.nx * y] = 1;
                 pass = false;
@@ -93,6 +120,132 @@ static bool verify(const input &input, float *output, int *errors) {
     return pass;
 }
 
+template <typename T>
+static std::vector<float> run_multichannel(const multichannel_input &input, ppc::fdostream &stream) {
+    std::vector<T> in(input.input.begin(), input.input.end());
+    std::vector<T> out(in.size());
+
+    ppc::perf timer;
+    timer.start();
+    mf(input.ny, input.nx, input.channels, input.hy, input.hx, in.data(), out.data());
+    timer.stop();
+    timer.print_to(stream);
+
+    return std::vector<float>(out.begin(), out.end());
+}
+
+static void test_multichannel(const multichannel_input &input, bool test, ppc::fdostream &stream) {
+    std::vector<float> output;
+    if (input.type == "uint8") {
+        output = run_multichannel<uint8_t>(input, stream);
+    } else if (input.type == "uint16") {
+        output = run_multichannel<uint16_t>(input, stream);
+    } else {
+        output = run_multichannel<float>(input, stream);
+    }
+
+    if (!test) {
+        stream << "result\tdone\n";
+        return;
+    }
+
+    // check every channel as a separate plane
+    const int n = input.ny * input.nx;
+    const bool integer = input.type != "float";
+    struct input plane = {input.ny, input.nx, input.hy, input.hx, std::vector<float>(n)};
+    std::vector<float> plane_output(n);
+    std::vector<int> errors(n);
+    bool pass = true;
+    for (int c = 0; c < input.channels; c++) {
+        for (int i = 0; i < n; i++) {
+            plane.input[i] = input.input[i * input.channels + c];
+            plane_output[i] = output[i * input.channels + c];
+        }
+        pass = verify(plane, plane_output.data(), errors.data(), integer) && pass;
+    }
+
+    if (!pass) {
+        stream
+            << "result\tfail\n"
+            << "ny\t" << input.ny << '\n'
+            << "nx\t" << input.nx << '\n'
+            << "hy\t" << input.hy << '\n'
+            << "hx\t" << input.hx << '\n'
+            << "size\tlarge\n";
+    } else {
+        stream << "result\tpass\n";
+    }
+}
+
+// Exact value of a rank query for a sorted window.
+static double expected_rank_value(const std::vector<double> &window, const rank_query &query) {
+    int n = window.size();
+    if (query.kind == rank_query::quantile) {
+        double p = std::min(1.0f, std::max(0.0f, query.q)) * double(n - 1);
+        int k = int(p);
+        return k + 1 < n ? window[k] + (p - k) * (window[k + 1] - window[k]) : window[k];
+    }
+    double q = std::min(0.5, std::max(0.0, double(query.q)));
+    int d = std::min(int(q * n), (n - 1) / 2);
+    double sum = 0;
+    for (int k = d; k < n - d; k++) {
+        sum += window[k];
+    }
+    return sum / (n - 2 * d);
+}
+
+static bool verify_rank(const input &input, const std::vector<rank_query> &queries,
+                        const std::vector<std::vector<float>> &outputs) {
+    std::vector<double> window;
+    auto check = [&](int y, int x) {
+        window.clear();
+        for (int j = std::max(0, y - input.hy); j < std::min(input.ny, y + input.hy + 1); j++) {
+            for (int i = std::max(0, x - input.hx); i < std::min(input.nx, x + input.hx + 1); i++) {
+                window.push_back(input.input[i + input.nx * j]);
+            }
+        }
+        std::sort(window.begin(), window.end());
+        for (size_t q = 0; q < queries.size(); q++) {
+            double expected = expected_rank_value(window, queries[q]);
+            double tolerance = 1e-6 * (1 + std::fabs(expected));
+            if (std::fabs(outputs[q][x + input.nx * y] - expected) > tolerance) {
+                return false;
+            }
+        }
+        return true;
+    };
+    uint64_t operation_count = uint64_t(input.ny) * input.nx * (2 * input.hy + 1) * (2 * input.hx + 1);
+    if (operation_count <= FULL_TEST_SIZE) {
+        for (int y = 0; y < input.ny; y++) {
+            for (int x = 0; x < input.nx; x++) {
+                if (!check(y, x)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    ppc::random rng;
+    for (uint64_t i = 0; i < FULL_TEST_SIZE; i += (2 * input.hy + 1) * (2 * input.hx + 1)) {
+        if (!check(rng.get_int32(0, input.ny - 1), rng.get_int32(0, input.nx - 1))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef PPC_STATS
+static void print_stats(ppc::fdostream &stream) {
+    stream
+        << "perf_mf_backend\t" << median_stats.backend << '\n'
+        << "perf_mf_predicted_ns\t" << median_stats.predicted_ns << '\n'
+        << "perf_mf_interior_ns\t" << median_stats.interior_ns << '\n'
+        << "perf_mf_border_ns\t" << median_stats.border_ns << '\n'
+        << "perf_mf_interior_pixels\t" << median_stats.interior_pixels << '\n'
+        << "perf_mf_border_pixels\t" << median_stats.border_pixels << '\n';
+}
+#endif
+
 int main(int argc, const char **argv) {
     const char *ppc_output = std::getenv("PPC_OUTPUT");
     int ppc_output_fd = 0;
@@ -132,6 +285,14 @@ int main(int argc, const char **argv) {
         CHECK_READ(input_file >> input_type);
     }
 
+    if (input_type == "random-multichannel") {
+        ppc::setup_cuda_device();
+        test_multichannel(generate_random_multichannel_input(input_file), test, *stream);
+        ppc::reset_cuda_device();
+        *stream << std::flush;
+        return 0;
+    }
+
     input input;
     if (input_type == "raw") {
         input = generate_raw_input(input_file);
@@ -142,19 +303,129 @@ int main(int argc, const char **argv) {
         return 3;
     }
 
+    // optional directives after the input:
+    //   approx <bits>   run mf_approx and check within its error bound
+    //   stream callback run mf_stream over the input in memory
+    //   stream file     run mf_file between temporary files
+    //   rank <count> (quantile|trimmed <q>)...
+    //                   run rank_filter with the given queries
+    int approx_bits = 0;
+    std::vector<rank_query> queries;
+    std::string stream_mode;
+    std::string directive;
+    while (input_file >> directive) {
+        if (directive == "approx") {
+            CHECK_READ(input_file >> approx_bits);
+        } else if (directive == "rank") {
+            int count;
+            CHECK_READ(input_file >> count);
+            for (int i = 0; i < count; i++) {
+                std::string kind;
+                rank_query query;
+                CHECK_READ(input_file >> kind >> query.q);
+                if (kind == "quantile") {
+                    query.kind = rank_query::quantile;
+                } else if (kind == "trimmed") {
+                    query.kind = rank_query::trimmed_mean;
+                } else {
+                    std::cerr << "Invalid rank query " << kind << std::endl;
+                    return 3;
+                }
+                queries.push_back(query);
+            }
+        } else if (directive == "stream") {
+            CHECK_READ(input_file >> stream_mode);
+            if (stream_mode != "callback" && stream_mode != "file") {
+                std::cerr << "Invalid stream mode " << stream_mode << std::endl;
+                return 3;
+            }
+        } else {
+            std::cerr << "Invalid directive " << directive << std::endl;
+            return 3;
+        }
+    }
+
     std::vector<float> output(input.nx * input.ny);
+    float bound = -1;
+    std::vector<std::vector<float>> rank_outputs(queries.size(), std::vector<float>(input.nx * input.ny));
+    std::vector<float *> rank_pointers;
+    for (auto &o : rank_outputs) {
+        rank_pointers.push_back(o.data());
+    }
+
+    std::string in_path, out_path;
+    if (stream_mode == "file") {
+        const char *tmpdir = std::getenv("TMPDIR");
+        std::string pattern = std::string(tmpdir ? tmpdir : "/tmp") + "/ppcmf-XXXXXX";
+        std::vector<char> name(pattern.begin(), pattern.end());
+        name.push_back('\0');
+        int fd = mkstemp(name.data());
+        if (fd < 0) {
+            std::cerr << "Failed to create temporary file" << std::endl;
+            return 2;
+        }
+        in_path = name.data();
+        out_path = in_path + ".out";
+        const char *bytes = reinterpret_cast<const char *>(input.input.data());
+        size_t left = input.input.size() * sizeof(float);
+        while (left > 0) {
+            ssize_t n = write(fd, bytes, left);
+            if (n <= 0) {
+                std::cerr << "Failed to write temporary file" << std::endl;
+                return 2;
+            }
+            bytes += n;
+            left -= n;
+        }
+        close(fd);
+    }
 
     ppc::setup_cuda_device();
     ppc::perf timer;
+#ifdef PPC_STATS
+    median_stats = {};
+#endif
     timer.start();
-    mf(input.ny, input.nx, input.hy, input.hx, input.input.data(), output.data());
+    if (!queries.empty()) {
+        rank_filter(input.ny, input.nx, input.hy, input.hx, queries.size(), queries.data(), input.input.data(),
+                    rank_pointers.data());
+    } else if (stream_mode == "callback") {
+        mf_stream(
+            input.ny, input.nx, input.hy, input.hx,
+            [&](int y, int rows, float *data) {
+                std::copy_n(input.input.data() + size_t(y) * input.nx, size_t(rows) * input.nx, data);
+            },
+            [&](int y, int rows, const float *data) {
+                std::copy_n(data, size_t(rows) * input.nx, output.data() + size_t(y) * input.nx);
+            });
+    } else if (stream_mode == "file") {
+        if (!mf_file(input.ny, input.nx, input.hy, input.hx, in_path.c_str(), out_path.c_str())) {
+            std::cerr << "mf_file failed" << std::endl;
+            return 2;
+        }
+    } else if (approx_bits) {
+        bound = mf_approx(input.ny, input.nx, input.hy, input.hx, approx_bits, input.input.data(), output.data());
+    } else {
+        mf(input.ny, input.nx, input.hy, input.hx, input.input.data(), output.data());
+    }
     timer.stop();
     timer.print_to(*stream);
+#ifdef PPC_STATS
+    print_stats(*stream);
+#endif
     ppc::reset_cuda_device();
 
+    if (stream_mode == "file") {
+        std::ifstream result(out_path, std::ios::binary);
+        result.read(reinterpret_cast<char *>(output.data()), output.size() * sizeof(float));
+        unlink(in_path.c_str());
+        unlink(out_path.c_str());
+    }
+
     if (test) {
         std::vector<int> errors(input.ny * input.nx);
-        bool pass = verify(input, output.data(), errors.data());
+        bool pass = queries.empty() ? verify(input, output.data(), errors.data(), false, bound)
+                                    : verify_rank(input, queries, rank_outputs);
 
         if (!pass) {
             bool small = input.ny * input.nx <= 200;
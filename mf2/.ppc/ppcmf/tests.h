@@ -30,7 +30,6 @@ static input generate_raw_input(std::ifstream &input_file) {
         }
         CHECK_END(line_reader);
     }
-    CHECK_END(input_file);
 
     return {ny, nx, hy, hx, data};
 }
@@ -39,7 +38,6 @@ static input generate_random_input(std::ifstream &input_file) {
     ppc::random rng;
     int ny, nx, hy, hx;
     CHECK_READ(input_file >> ny >> nx >> hy >> hx);
-    CHECK_END(input_file);
 
     std::vector<float> data(ny * nx);
     for (int y = 0; y < ny; y++) {
@@ -49,4 +47,41 @@ static input generate_random_input(std::ifstream &input_file) {
     }
 
     return {ny, nx, hy, hx, data};
-}
\ No newline at end of file
+}
+
+// Interleaved image with `channels` values per pixel, stored as floats;
+// `type` is the element type passed to mf: uint8, uint16 or float.
+struct multichannel_input {
+    int ny;
+    int nx;
+    int hy;
+    int hx;
+    int channels;
+    std::string type;
+    std::vector<float> input;
+};
+
+static multichannel_input generate_random_multichannel_input(std::ifstream &input_file) {
+    ppc::random rng;
+    int ny, nx, hy, hx, channels;
+    std::string type;
+    CHECK_READ(input_file >> ny >> nx >> hy >> hx >> channels >> type);
+    CHECK_END(input_file);
+    if (type != "uint8" && type != "uint16" && type != "float") {
+        std::cerr << "Invalid element type " << type << std::endl;
+        std::exit(3);
+    }
+
+    std::vector<float> data(ny * nx * channels);
+    for (float &v : data) {
+        if (type == "uint8") {
+            v = rng.get_int32(0, 255);
+        } else if (type == "uint16") {
+            v = rng.get_int32(0, 65535);
+        } else {
+            v = rng.get_float();
+        }
+    }
+
+    return {ny, nx, hy, hx, channels, type, data};
+}
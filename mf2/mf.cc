@@ -1,52 +1,1499 @@
+#include "mf.h"
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
-void mf(int ny, int nx, int hy, int hx, const float *in, float *out)
+#ifdef PPC_STATS
+MedianStats median_stats;
+
+static long long stats_clock()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#define STATS(x) x
+#else
+#define STATS(x)
+#endif
+
+/*
+Tiled execution. The output is split into rectangular tiles; a tile and its
+halo (the pixels its windows reach) are sized to stay in L2 while the tile
+is being filtered. Every thread owns one scratch object of the engine,
+allocated once and reused for all of its tiles, and gets a contiguous run
+of tiles in row-major order so that consecutive tiles share their halo.
+*/
+
+constexpr int L2_BYTES = 256 * 1024;
+
+struct Tile
+{
+  int y0, y1, x0, x1; // output pixels [y0, y1) x [x0, x1)
+};
+
+static inline long long pixels_of(const Tile &a)
+{
+  return (long long)(a.y1 - a.y0) * (a.x1 - a.x0);
+}
+
+// whether the windows of all pixels of the area have the full size
+static inline bool is_interior(int ny, int nx, int hy, int hx, const Tile &a)
+{
+  return a.y0 >= hy && a.y1 <= ny - hy && a.x0 >= hx && a.x1 <= nx - hx;
+}
+
+// tiles covering an area of the output
+struct Tiling
+{
+  Tile area;
+  int th, tw, tiles_y, tiles_x;
+};
+
+// tiles whose region with halo has about L2_BYTES / bytes_per_pixel pixels;
+// for large windows the tiles grow to the size of the halo instead, so that
+// at most 3/4 of a region is halo
+static Tiling make_tiling(int hy, int hx, const Tile &area, int bytes_per_pixel, int min_tile)
 {
+  const int side = int(sqrt(double(L2_BYTES) / bytes_per_pixel));
+  Tiling t;
+  t.area = area;
+  t.th = min(area.y1 - area.y0, max({min_tile, side - 2 * hy, 2 * hy}));
+  t.tw = min(area.x1 - area.x0, max({min_tile, side - 2 * hx, 2 * hx}));
+  t.tiles_y = (area.y1 - area.y0 + t.th - 1) / t.th;
+  t.tiles_x = (area.x1 - area.x0 + t.tw - 1) / t.tw;
+  return t;
+}
 
-#pragma omp parallel for schedule(static, 1)
-  // sliding window (moving down first then moving towards right)
-  for (int y = 0; y < ny; y++)
+template <typename Scratch, typename Kernel>
+static void for_each_tile(const Tiling &t, Kernel kernel)
+{
+  const int tiles = t.tiles_y * t.tiles_x;
+
+#pragma omp parallel
   {
-    for (int x = 0; x < nx; x++)
+    Scratch scratch;
+#pragma omp for schedule(static)
+    for (int k = 0; k < tiles; k++)
     {
-      // window boundaries
-      int xmin = (x - hx) > 0 ? (x - hx) : 0;
-      int ymin = (y - hy) > 0 ? (y - hy) : 0;
-      int xmax = (x + hx + 1) > nx ? nx : (x + hx + 1);
-      int ymax = (y + hy + 1) > ny ? ny : (y + hy + 1);
+      const int ty = k / t.tiles_x, tx = k % t.tiles_x;
+      const Tile &a = t.area;
+      Tile tile{a.y0 + ty * t.th, min(a.y1, a.y0 + (ty + 1) * t.th), a.x0 + tx * t.tw, min(a.x1, a.x0 + (tx + 1) * t.tw)};
+      kernel(tile, scratch);
+    }
+  }
+}
+
+// A window of rows [y0, y1) and columns [x0, x1) that is moved by adding and
+// removing whole rows and columns: row(j, delta) adds (delta = 1) or removes
+// (delta = -1) row j over the current columns, column(i, delta) likewise.
+struct Window
+{
+  int y0 = 0, y1 = 0, x0 = 0, x1 = 0;
+
+  int size() const { return (y1 - y0) * (x1 - x0); }
 
-      // generate new window
-      const int window_size = (xmax - xmin) * (ymax - ymin);
-      vector<float> window(window_size);
+  template <typename Row, typename Column>
+  void move(int ny0, int ny1, int nx0, int nx1, Row row, Column column)
+  {
+    for (; y0 < ny0; y0++)
+      row(y0, -1);
+    for (; y1 > ny1; y1--)
+      row(y1 - 1, -1);
+    for (; x0 < nx0; x0++)
+      column(x0, -1);
+    for (; x1 > nx1; x1--)
+      column(x1 - 1, -1);
+    if (y0 == y1 || x0 == x1)
+    {
+      y0 = y1 = ny0;
+      x0 = x1 = nx0;
+    }
+    for (; y0 > ny0; y0--)
+      row(y0 - 1, 1);
+    for (; y1 < ny1; y1++)
+      row(y1, 1);
+    for (; x0 > nx0; x0--)
+      column(x0 - 1, 1);
+    for (; x1 < nx1; x1++)
+      column(x1, 1);
+  }
+};
 
-      // fill in window
-      int idx = 0;
+/*
+Rank-order filtering. Every engine slides a window over the image and, for
+each output pixel, calls emit(x, y, n, select, sum) where n is the size of
+the window, select(k) returns its k-th smallest value and sum(lo, hi) the
+sum of the values of ranks lo ... hi - 1, in O(n) rather than one selection
+per rank. What is computed from the window (the median, percentiles, a
+trimmed mean) is up to emit, so all ranks requested for a pixel share the
+window state of the engine.
+*/
 
-      for (int j = ymin; j < ymax; ++j)
+// median as mf defines it: the mean of the two middle values for even n
+template <typename Select>
+static inline float median_of(int n, Select &&select)
+{
+  if (n % 2 == 0)
+  {
+    float left = select(n / 2);
+    float right = select(n / 2 - 1);
+    return (left + right) / 2.0;
+  }
+  return select(n / 2);
+}
+
+// emitter that stores the median in out
+static inline auto median_to(int nx, float *out)
+{
+  return [=](int x, int y, int n, auto &&select, auto &&)
+  { out[x + nx * y] = median_of(n, select); };
+}
+
+// k-th smallest of window[0, n) by nth_element. Every call leaves the range
+// [lo, hi) holding exactly the values of ranks lo ... hi - 1, so the next
+// call only partitions the part on its side of the previous result.
+struct WindowSelect
+{
+  float *window;
+  int n, lo = 0, hi, last = -1;
+
+  WindowSelect(float *window, int n) : window(window), n(n), hi(n) {}
+
+  float operator()(int k)
+  {
+    if (last >= 0)
+    {
+      if (k == last)
+      {
+        return window[k];
+      }
+      if (k < last)
       {
-        for (int i = xmin; i < xmax; ++i)
+        hi = last;
+      }
+      else
+      {
+        lo = last + 1;
+      }
+    }
+    if (k < lo || k >= hi)
+    {
+      lo = 0;
+      hi = n;
+    }
+    nth_element(window + lo, window + k, window + hi);
+    last = k;
+    return window[k];
+  }
+
+  // sum of ranks [a, b), which two partitions move to window[a, b)
+  double sum(int a, int b)
+  {
+    nth_element(window, window + a, window + n);
+    if (b - 1 > a)
+    {
+      nth_element(window + a + 1, window + b - 1, window + n);
+    }
+    lo = 0;
+    hi = n;
+    last = -1;
+    double s = 0;
+    for (int k = a; k < b; k++)
+    {
+      s += window[k];
+    }
+    return s;
+  }
+};
+
+// by selection on a copy of the window of every pixel
+
+constexpr int SELECT_MIN_TILE = 32;
+
+struct SelectScratch
+{
+  vector<float> window;
+};
+
+// copies the window around (y, x) into `window` and returns its size
+static inline int fill_window(int ny, int nx, int hy, int hx, const float *in, int y, int x, float *window)
+{
+  // window boundaries
+  int xmin = (x - hx) > 0 ? (x - hx) : 0;
+  int ymin = (y - hy) > 0 ? (y - hy) : 0;
+  int xmax = (x + hx + 1) > nx ? nx : (x + hx + 1);
+  int ymax = (y + hy + 1) > ny ? ny : (y + hy + 1);
+
+  // fill in window
+  int idx = 0;
+
+  for (int j = ymin; j < ymax; ++j)
+  {
+    for (int i = xmin; i < xmax; ++i)
+    {
+      window[idx++] = in[i + nx*j];
+    }
+  }
+  return idx;
+}
+
+// copies the window around the interior pixel (y, x), which has the full
+// (2 hy + 1) x (2 hx + 1) pixels, into `window`
+static inline void fill_interior_window(int nx, int hy, int hx, const float *in, int y, int x, float *window)
+{
+  const int w = 2 * hx + 1;
+  const float *p = in + (x - hx) + nx * (y - hy);
+  for (int j = 0; j <= 2 * hy; j++)
+  {
+    memcpy(window + w * j, p + nx * j, w * sizeof(float));
+  }
+}
+
+// median of the window around (y, x), using `window` as scratch
+static inline float select_pixel(int ny, int nx, int hy, int hx, const float *in, int y, int x, float *window)
+{
+  const int window_size = fill_window(ny, nx, hy, hx, in, y, x, window);
+  return median_of(window_size, WindowSelect(window, window_size));
+}
+
+template <typename Emit>
+static inline void emit_window(Emit &emit, int x, int y, float *window, int n)
+{
+  WindowSelect select(window, n);
+  emit(x, y, n, select, [&](int a, int b) { return select.sum(a, b); });
+}
+
+template <typename Emit>
+static void mf_select_tile(int ny, int nx, int hy, int hx, const float *in, Emit &emit,
+                           const Tile &tile, SelectScratch &s)
+{
+  const int n = (2 * hy + 1) * (2 * hx + 1);
+  s.window.resize(n);
+
+  if (is_interior(ny, nx, hy, hx, tile))
+  {
+    for (int y = tile.y0; y < tile.y1; y++)
+    {
+      for (int x = tile.x0; x < tile.x1; x++)
+      {
+        fill_interior_window(nx, hy, hx, in, y, x, s.window.data());
+        emit_window(emit, x, y, s.window.data(), n);
+      }
+    }
+    return;
+  }
+  for (int y = tile.y0; y < tile.y1; y++)
+  {
+    for (int x = tile.x0; x < tile.x1; x++)
+    {
+      const int window_size = fill_window(ny, nx, hy, hx, in, y, x, s.window.data());
+      emit_window(emit, x, y, s.window.data(), window_size);
+    }
+  }
+}
+
+template <typename Emit>
+static void mf_select(int ny, int nx, int hy, int hx, const float *in, Emit emit, const Tile &area)
+{
+  const int bytes_per_pixel = sizeof(float);
+  const Tiling t = make_tiling(hy, hx, area, bytes_per_pixel, SELECT_MIN_TILE);
+  for_each_tile<SelectScratch>(t, [&](const Tile &tile, SelectScratch &s)
+                               { mf_select_tile(ny, nx, hy, hx, in, emit, tile, s); });
+}
+
+/*
+Small windows (hx, hy <= 3). The window size is a template parameter, and
+eight horizontally adjacent interior pixels are filtered at once: element e
+of the window of all eight is one unaligned vector load, and the median is
+found by forgetful selection. The first n / 2 + 2 elements are loaded; then
+repeatedly the minimum and maximum are moved to the ends with compare-and-
+exchange steps and dropped, and the next element takes their place. When
+all elements have been seen, three are left and the middle one is the
+median. These kernels only filter the interior; the border is left to the
+select engine.
+*/
+
+constexpr int SMALL_MAX_H = 3;
+constexpr int LANES = 8;
+
+typedef float float8_t __attribute__((vector_size(LANES * sizeof(float))));
+
+static inline float8_t load8(const float *p)
+{
+  float8_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void compare_exchange(float8_t &a, float8_t &b)
+{
+  float8_t lo = a < b ? a : b;
+  b = a < b ? b : a;
+  a = lo;
+}
+
+// medians of the windows around (y, x), ..., (y, x + LANES - 1), which must
+// all be interior pixels; p points to (y, x)
+template <int HY, int HX>
+static inline float8_t median8(const float *p, int nx)
+{
+  constexpr int W = 2 * HX + 1;
+  constexpr int N = (2 * HY + 1) * W;
+  constexpr int KEEP = N / 2 + 2;
+  auto element = [&](int e) { return load8(p + (e / W - HY) * nx + (e % W - HX)); };
+
+  float8_t v[KEEP];
+#pragma GCC unroll 64
+  for (int e = 0; e < KEEP; e++)
+  {
+    v[e] = element(e);
+  }
+#pragma GCC unroll 64
+  for (int e = KEEP; e <= N; e++)
+  {
+    // with b candidates, v[0] becomes their minimum and v[b - 1] their maximum
+    const int b = KEEP - (e - KEEP);
+#pragma GCC unroll 64
+    for (int i = 1; i < b; i++)
+    {
+      compare_exchange(v[0], v[i]);
+    }
+#pragma GCC unroll 64
+    for (int i = 1; i < b - 1; i++)
+    {
+      compare_exchange(v[i], v[b - 1]);
+    }
+    if (e < N)
+    {
+      v[0] = element(e);
+    }
+  }
+  return v[1];
+}
+
+// the tile must be interior
+template <int HY, int HX>
+static void mf_small_tile(int nx, const float *in, float *out, const Tile &tile, SelectScratch &s)
+{
+  constexpr int N = (2 * HY + 1) * (2 * HX + 1);
+  s.window.resize(N);
+
+  for (int y = tile.y0; y < tile.y1; y++)
+  {
+    int x = tile.x0;
+    for (; x + LANES <= tile.x1; x += LANES)
+    {
+      float8_t m = median8<HY, HX>(in + x + nx*y, nx);
+      memcpy(out + x + nx*y, &m, sizeof(m));
+    }
+    for (; x < tile.x1; x++)
+    {
+      fill_interior_window(nx, HY, HX, in, y, x, s.window.data());
+      out[x + nx*y] = median_of(N, WindowSelect(s.window.data(), N));
+    }
+  }
+}
+
+// the area must be interior
+template <int HY, int HX>
+static void mf_small(int nx, const float *in, float *out, const Tile &area)
+{
+  const int bytes_per_pixel = sizeof(float);
+  const Tiling t = make_tiling(HY, HX, area, bytes_per_pixel, SELECT_MIN_TILE);
+  for_each_tile<SelectScratch>(t, [&](const Tile &tile, SelectScratch &s)
+                               { mf_small_tile<HY, HX>(nx, in, out, tile, s); });
+}
+
+// interior kernels for 1 <= hy, hx <= SMALL_MAX_H, indexed by [hy - 1][hx - 1]
+typedef void (*small_kernel)(int nx, const float *in, float *out, const Tile &area);
+
+static const small_kernel small_kernels[SMALL_MAX_H][SMALL_MAX_H] = {
+    {mf_small<1, 1>, mf_small<1, 2>, mf_small<1, 3>},
+    {mf_small<2, 1>, mf_small<2, 2>, mf_small<2, 3>},
+    {mf_small<3, 1>, mf_small<3, 2>, mf_small<3, 3>},
+};
+
+/*
+Sliding-window histogram median (Huang, with the column histograms of
+Perreault and Hebert). The image is processed in tiles. Inside a tile, the
+pixels of the tile and its halo are replaced by their ranks, so that every
+rank occurs exactly once. Ranks are grouped into coarse bins of 256.
+
+For every column of the tile there is a histogram of the coarse bins over
+the rows of the current window; moving one row down adds and removes one
+pixel per column. The window histogram is the sum of the column histograms
+of its columns; moving one pixel right adds one column histogram and
+subtracts another. The coarse bin of the median is found by a scan of the
+window histogram, and the median inside it by checking which of its 256
+ranks lie inside the window. None of this depends on the window size.
+*/
+
+constexpr int BIN_BITS = 8;
+constexpr int BIN_SIZE = 1 << BIN_BITS;
+
+constexpr int HISTOGRAM_MIN_TILE = 16;
+
+// float bits in an order that agrees with the order of the values
+static inline uint32_t ordered_bits(float v)
+{
+  uint32_t u;
+  memcpy(&u, &v, sizeof(u));
+  return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+struct HistogramScratch
+{
+  vector<uint64_t> keys;
+  vector<float> value_of;          // value of each rank
+  vector<uint16_t> row_of, col_of; // position of each rank in the region
+  vector<uint32_t> rank;           // rank of each pixel of the region
+  vector<uint16_t> column_hist, window_hist;
+};
+
+template <typename Emit>
+static void mf_histogram_tile(int ny, int nx, int hy, int hx, const float *in, Emit &emit,
+                              const Tile &tile, HistogramScratch &s)
+{
+  const int oy0 = tile.y0, oy1 = tile.y1, ox0 = tile.x0, ox1 = tile.x1;
+  const int iy0 = max(0, oy0 - hy), iy1 = min(ny, oy1 + hy);
+  const int ix0 = max(0, ox0 - hx), ix1 = min(nx, ox1 + hx);
+  const int rh = iy1 - iy0, rw = ix1 - ix0;
+  const int m = rh * rw;
+  const int bins = (m + BIN_SIZE - 1) >> BIN_BITS;
+
+  // ranks of the region
+  s.keys.resize(m);
+  for (int j = 0; j < rh; j++)
+  {
+    for (int i = 0; i < rw; i++)
+    {
+      uint32_t idx = i + rw * j;
+      s.keys[idx] = (uint64_t(ordered_bits(in[(ix0 + i) + nx * (iy0 + j)])) << 32) | idx;
+    }
+  }
+  sort(s.keys.begin(), s.keys.end());
+  s.value_of.resize(m);
+  s.row_of.resize(m);
+  s.col_of.resize(m);
+  s.rank.resize(m);
+  for (int r = 0; r < m; r++)
+  {
+    uint32_t idx = uint32_t(s.keys[r]);
+    s.rank[idx] = r;
+    s.row_of[r] = idx / rw;
+    s.col_of[r] = idx % rw;
+    s.value_of[r] = in[(ix0 + idx % rw) + nx * (iy0 + idx / rw)];
+  }
+
+  s.column_hist.assign(size_t(rw) * bins, 0);
+  s.window_hist.resize(bins);
+  auto column = [&](int i) { return &s.column_hist[size_t(i) * bins]; };
+  auto update_row = [&](int j, int delta)
+  {
+    for (int i = 0; i < rw; i++)
+    {
+      column(i)[s.rank[i + rw * j] >> BIN_BITS] += delta;
+    }
+  };
+
+  // rows [wy0, wy1) of the region are in the column histograms
+  int wy0 = 0, wy1 = 0;
+  for (int y = oy0; y < oy1; y++)
+  {
+    const int ny0 = max(0, y - hy) - iy0, ny1 = min(ny, y + hy + 1) - iy0;
+    for (; wy1 < ny1; wy1++)
+    {
+      update_row(wy1, 1);
+    }
+    for (; wy0 < ny0; wy0++)
+    {
+      update_row(wy0, -1);
+    }
+
+    // columns [wx0, wx1) of the region are in the window histogram
+    int wx0 = max(0, ox0 - hx) - ix0, wx1 = wx0;
+    fill(s.window_hist.begin(), s.window_hist.end(), 0);
+    for (int x = ox0; x < ox1; x++)
+    {
+      const int nx0 = max(0, x - hx) - ix0, nx1 = min(nx, x + hx + 1) - ix0;
+      for (; wx1 < nx1; wx1++)
+      {
+        const uint16_t *h = column(wx1);
+        for (int b = 0; b < bins; b++)
+        {
+          s.window_hist[b] += h[b];
+        }
+      }
+      for (; wx0 < nx0; wx0++)
+      {
+        const uint16_t *h = column(wx0);
+        for (int b = 0; b < bins; b++)
         {
-          window[idx++] = in[i + nx*j];
+          s.window_hist[b] -= h[b];
         }
       }
 
-      // calculate median
-      if (window_size % 2 == 0)
+      auto inside = [&](int r)
+      {
+        int j = s.row_of[r], i = s.col_of[r];
+        return wy0 <= j && j < wy1 && wx0 <= i && i < wx1;
+      };
+      // rank of the k-th smallest pixel of the window
+      auto select = [&](int k)
+      {
+        int b = 0;
+        while (k >= s.window_hist[b])
+        {
+          k -= s.window_hist[b++];
+        }
+        for (int r = b << BIN_BITS;; r++)
+        {
+          if (inside(r) && k-- == 0)
+          {
+            return r;
+          }
+        }
+      };
+      // the ranks after the a-th smallest pixel are found by walking on
+      auto sum = [&](int a, int b)
+      {
+        double total = 0;
+        for (int r = select(a); a < b; r++)
+        {
+          if (inside(r))
+          {
+            total += s.value_of[r];
+            a++;
+          }
+        }
+        return total;
+      };
+
+      const int window_size = (wx1 - wx0) * (wy1 - wy0);
+      emit(x, y, window_size, [&](int k) { return s.value_of[select(k)]; }, sum);
+    }
+  }
+}
+
+template <typename Emit>
+static void mf_histogram(int ny, int nx, int hy, int hx, const float *in, Emit emit, const Tile &area)
+{
+  // sliding the windows touches only the rank of each pixel
+  const int bytes_per_pixel = 4;
+  const Tiling t = make_tiling(hy, hx, area, bytes_per_pixel, HISTOGRAM_MIN_TILE);
+  for_each_tile<HistogramScratch>(t, [&](const Tile &tile, HistogramScratch &s)
+                                  { mf_histogram_tile(ny, nx, hy, hx, in, emit, tile, s); });
+}
+
+/*
+Bitset median for large windows. The area and its halo are sorted once and
+every pixel is replaced by its global rank. Each tile then sorts the global ranks
+of its pixels and halo, which gives local ranks without comparing floats
+again, and keeps the window as a bitset over the local ranks. The window
+walks the tile in snake order, so every step toggles one row or column of
+bits, and the k-th set bit is found with per-block counts and popcounts.
+*/
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// words of the bitset summarised by one block count
+constexpr int BLOCK_WORDS = 8;
+
+constexpr int BITSET_MIN_TILE = 64;
+
+// index of the k-th set bit of w
+static inline int select_bit(uint64_t w, int k)
+{
+#ifdef __BMI2__
+  return __builtin_ctzll(_pdep_u64(uint64_t(1) << k, w));
+#else
+  for (; k > 0; k--)
+  {
+    w &= w - 1;
+  }
+  return __builtin_ctzll(w);
+#endif
+}
+
+// stable LSD radix sort of keys by their high 32 bits, of which only the
+// lowest `bits` can be nonzero
+static void radix_sort_high(vector<uint64_t> &keys, vector<uint64_t> &buffer, int bits)
+{
+  constexpr int DIGIT = 11;
+  uint32_t count[1 << DIGIT];
+  buffer.resize(keys.size());
+  for (int shift = 32; shift < 32 + bits; shift += DIGIT)
+  {
+    memset(count, 0, sizeof(count));
+    for (uint64_t k : keys)
+    {
+      count[(k >> shift) & ((1 << DIGIT) - 1)]++;
+    }
+    uint32_t sum = 0;
+    for (uint32_t &c : count)
+    {
+      uint32_t t = c;
+      c = sum;
+      sum += t;
+    }
+    for (uint64_t k : keys)
+    {
+      buffer[count[(k >> shift) & ((1 << DIGIT) - 1)]++] = k;
+    }
+    keys.swap(buffer);
+  }
+}
+
+struct BitsetScratch
+{
+  vector<uint64_t> keys, buffer;
+  vector<uint32_t> global_of; // global rank of each local rank
+  vector<uint32_t> local;     // local rank of each pixel of the region
+  vector<uint32_t> local_t;   // the same, column by column
+  vector<uint64_t> bits;
+  vector<uint32_t> counts;
+};
+
+// rank holds the global ranks of the pixels of rect, row by row
+template <typename Emit>
+static void mf_bitset_tile(int ny, int nx, int hy, int hx, const Tile &rect, const uint32_t *rank, int rank_bits,
+                           const float *value_of, Emit &emit, const Tile &tile, BitsetScratch &s)
+{
+  const int oy0 = tile.y0, oy1 = tile.y1, ox0 = tile.x0, ox1 = tile.x1;
+  const int iy0 = max(0, oy0 - hy), iy1 = min(ny, oy1 + hy);
+  const int ix0 = max(0, ox0 - hx), ix1 = min(nx, ox1 + hx);
+  const int rh = iy1 - iy0, rw = ix1 - ix0;
+  const int m = rh * rw;
+  const int words = (m + 63) / 64;
+  const int blocks = (words + BLOCK_WORDS - 1) / BLOCK_WORDS;
+
+  // local ranks of the region, by sorting its global ranks
+  s.keys.resize(m);
+  for (int j = 0; j < rh; j++)
+  {
+    for (int i = 0; i < rw; i++)
+    {
+      uint32_t idx = i + rw * j;
+      s.keys[idx] = (uint64_t(rank[(ix0 - rect.x0 + i) + (rect.x1 - rect.x0) * (iy0 - rect.y0 + j)]) << 32) | idx;
+    }
+  }
+  radix_sort_high(s.keys, s.buffer, rank_bits);
+  s.global_of.resize(m);
+  s.local.resize(m);
+  s.local_t.resize(m);
+  for (int r = 0; r < m; r++)
+  {
+    uint32_t idx = uint32_t(s.keys[r]);
+    s.global_of[r] = s.keys[r] >> 32;
+    s.local[idx] = r;
+    s.local_t[idx / rw + rh * (idx % rw)] = r;
+  }
+
+  s.bits.assign(words, 0);
+  s.counts.assign(blocks, 0);
+
+  // the search for the k-th set bit starts from the block of the previous
+  // one; `below` is the number of set bits in the blocks before it
+  int hint = 0, below = 0;
+
+  // the window, in coordinates of the region
+  Window w;
+  auto toggle = [&](uint32_t r, int delta)
+  {
+    s.bits[r / 64] ^= uint64_t(1) << (r % 64);
+    int b = r / 64 / BLOCK_WORDS;
+    s.counts[b] += delta;
+    below += b < hint ? delta : 0;
+  };
+  auto toggle_row = [&](int j, int delta)
+  {
+    for (int i = w.x0; i < w.x1; i++)
+    {
+      toggle(s.local[i + rw * j], delta);
+    }
+  };
+  auto toggle_column = [&](int i, int delta)
+  {
+    for (int j = w.y0; j < w.y1; j++)
+    {
+      toggle(s.local_t[j + rh * i], delta);
+    }
+  };
+
+  // local rank of the k-th smallest pixel of the window
+  auto select = [&](int k)
+  {
+    int b = hint;
+    while (k < below)
+    {
+      below -= s.counts[--b];
+    }
+    while (k >= below + int(s.counts[b]))
+    {
+      below += s.counts[b++];
+    }
+    hint = b;
+    k -= below;
+    int w = b * BLOCK_WORDS;
+    for (;; w++)
+    {
+      int c = __builtin_popcountll(s.bits[w]);
+      if (k < c)
       {
-        nth_element(window.begin(), window.begin() + window_size / 2, window.end());
-        float left = window[window_size / 2];
-        nth_element(window.begin(), window.begin() + window_size / 2 - 1, window.end());
-        float right = window[window_size / 2 - 1];
-        out[x + nx*y] = (left + right) / 2.0;
+        break;
       }
-      else
+      k -= c;
+    }
+    return 64 * w + select_bit(s.bits[w], k);
+  };
+  // the ranks after the a-th smallest pixel are the next set bits
+  auto sum = [&](int a, int b)
+  {
+    const int r = select(a);
+    int word = r / 64;
+    uint64_t bits = s.bits[word] & (~uint64_t(0) << (r % 64));
+    double total = 0;
+    for (; a < b; a++)
+    {
+      while (bits == 0)
       {
-        nth_element(window.begin(), window.begin() + window_size / 2, window.end());
-        out[x + nx*y] = window[window_size / 2];
+        bits = s.bits[++word];
       }
+      total += value_of[s.global_of[64 * word + __builtin_ctzll(bits)]];
+      bits &= bits - 1;
     }
+    return total;
+  };
+
+  auto move_to = [&](int y, int x)
+  {
+    w.move(max(0, y - hy) - iy0, min(ny, y + hy + 1) - iy0, max(0, x - hx) - ix0, min(nx, x + hx + 1) - ix0,
+           toggle_row, toggle_column);
+  };
+
+  for (int y = oy0; y < oy1; y++)
+  {
+    const bool forward = (y - oy0) % 2 == 0;
+    for (int step = 0; step < ox1 - ox0; step++)
+    {
+      const int x = forward ? ox0 + step : ox1 - 1 - step;
+      move_to(y, x);
+      emit(x, y, w.size(), [&](int k) { return value_of[s.global_of[select(k)]]; }, sum);
+    }
+  }
+}
+
+template <typename Emit>
+static void mf_bitset(int ny, int nx, int hy, int hx, const float *in, Emit emit, const Tile &area)
+{
+  // global ranks of the area and its halo
+  const Tile rect{max(0, area.y0 - hy), min(ny, area.y1 + hy), max(0, area.x0 - hx), min(nx, area.x1 + hx)};
+  const int rw = rect.x1 - rect.x0;
+  const int n = pixels_of(rect);
+  auto pixel = [&](uint32_t idx) { return in[(rect.x0 + idx % rw) + nx * (rect.y0 + idx / rw)]; };
+
+  vector<uint64_t> keys(n);
+#pragma omp parallel for
+  for (int idx = 0; idx < n; idx++)
+  {
+    keys[idx] = (uint64_t(ordered_bits(pixel(idx))) << 32) | uint32_t(idx);
+  }
+  sort(keys.begin(), keys.end());
+  vector<uint32_t> rank(n);
+  vector<float> value_of(n);
+#pragma omp parallel for
+  for (int r = 0; r < n; r++)
+  {
+    uint32_t idx = uint32_t(keys[r]);
+    rank[idx] = r;
+    value_of[r] = pixel(idx);
+  }
+  vector<uint64_t>().swap(keys);
+  int rank_bits = 1;
+  while ((int64_t(1) << rank_bits) < n)
+  {
+    rank_bits++;
+  }
+
+  // local ranks in both layouts and the global rank of each local rank
+  const int bytes_per_pixel = 12;
+  const Tiling t = make_tiling(hy, hx, area, bytes_per_pixel, BITSET_MIN_TILE);
+  for_each_tile<BitsetScratch>(t, [&](const Tile &tile, BitsetScratch &s)
+                               { mf_bitset_tile(ny, nx, hy, hx, rect, rank.data(), rank_bits, value_of.data(), emit, tile, s); });
+}
+
+/*
+Counting median for interleaved integer images. Each channel has a
+two-level histogram of its values in the window: coarse counts of the high
+half of the bits and fine counts of all values. The window walks each tile
+in snake order, and every pixel that enters or leaves it updates the
+histograms of all of its channels at once. The coarse bin of the median is
+found by walking from the bin of the previous median, and the value inside
+it by a scan of its fine counts.
+*/
+
+template <int BITS>
+struct CountingScratch
+{
+  static constexpr int FINE_BITS = BITS / 2;
+  static constexpr int COARSE = 1 << (BITS - FINE_BITS);
+  static constexpr int FINE = 1 << BITS;
+
+  vector<uint32_t> coarse, fine;
+  vector<int> hint, below; // coarse bin of the previous median, and count below it
+  int channels = 0;
+
+  void reset(int c)
+  {
+    if (channels != c)
+    {
+      channels = c;
+      coarse.assign(size_t(c) * COARSE, 0);
+      fine.assign(size_t(c) * FINE, 0);
+    }
+    hint.assign(c, 0);
+    below.assign(c, 0);
+  }
+
+  void add(int ch, int v, int delta)
+  {
+    int b = v >> FINE_BITS;
+    coarse[size_t(ch) * COARSE + b] += delta;
+    fine[size_t(ch) * FINE + v] += delta;
+    below[ch] += b < hint[ch] ? delta : 0;
+  }
+
+  // the k-th smallest value of channel ch
+  int select(int ch, int k)
+  {
+    const uint32_t *c = &coarse[size_t(ch) * COARSE];
+    int b = hint[ch];
+    while (k < below[ch])
+    {
+      below[ch] -= c[--b];
+    }
+    while (k >= below[ch] + int(c[b]))
+    {
+      below[ch] += c[b++];
+    }
+    hint[ch] = b;
+    k -= below[ch];
+    const uint32_t *f = &fine[size_t(ch) * FINE + (b << FINE_BITS)];
+    int v = 0;
+    while (k >= int(f[v]))
+    {
+      k -= f[v++];
+    }
+    return (b << FINE_BITS) + v;
+  }
+};
+
+// store(x, y, ch, lo, hi) gets the two middle values of channel ch of the
+// window of (y, x); they are equal for odd windows
+template <int BITS, typename T, typename Store>
+static void mf_counting_tile(int ny, int nx, int channels, int hy, int hx, const T *in, Store store,
+                             const Tile &tile, CountingScratch<BITS> &s)
+{
+  s.reset(channels);
+  Window w;
+  auto toggle_row = [&](int j, int delta)
+  {
+    const T *p = in + size_t(channels) * (w.x0 + size_t(nx) * j);
+    for (int i = 0; i < (w.x1 - w.x0) * channels; i += channels)
+    {
+      for (int ch = 0; ch < channels; ch++)
+      {
+        s.add(ch, p[i + ch], delta);
+      }
+    }
+  };
+  auto toggle_column = [&](int i, int delta)
+  {
+    for (int j = w.y0; j < w.y1; j++)
+    {
+      const T *p = in + size_t(channels) * (i + size_t(nx) * j);
+      for (int ch = 0; ch < channels; ch++)
+      {
+        s.add(ch, p[ch], delta);
+      }
+    }
+  };
+
+  for (int y = tile.y0; y < tile.y1; y++)
+  {
+    const bool forward = (y - tile.y0) % 2 == 0;
+    for (int step = 0; step < tile.x1 - tile.x0; step++)
+    {
+      const int x = forward ? tile.x0 + step : tile.x1 - 1 - step;
+      w.move(max(0, y - hy), min(ny, y + hy + 1), max(0, x - hx), min(nx, x + hx + 1), toggle_row, toggle_column);
+      const int window_size = w.size();
+      for (int ch = 0; ch < channels; ch++)
+      {
+        int hi = s.select(ch, window_size / 2);
+        int lo = window_size % 2 == 0 ? s.select(ch, window_size / 2 - 1) : hi;
+        store(x, y, ch, lo, hi);
+      }
+    }
+  }
+
+  // leave the histograms empty for the next tile
+  for (int j = w.y0; j < w.y1; j++)
+  {
+    toggle_row(j, -1);
+  }
+}
+
+template <int BITS, typename T, typename Store>
+static void mf_counting(int ny, int nx, int channels, int hy, int hx, const T *in, Store store)
+{
+  const Tile area{0, ny, 0, nx};
+  // the input values of the region, all channels
+  const int bytes_per_pixel = channels * sizeof(T);
+  const Tiling t = make_tiling(hy, hx, area, bytes_per_pixel, BITSET_MIN_TILE);
+  for_each_tile<CountingScratch<BITS>>(t, [&](const Tile &tile, CountingScratch<BITS> &s)
+                                       { mf_counting_tile(ny, nx, channels, hy, hx, in, store, tile, s); });
+}
+
+template <typename T>
+static void mf_counting(int ny, int nx, int channels, int hy, int hx, const T *in, T *out)
+{
+  mf_counting<8 * sizeof(T)>(ny, nx, channels, hy, hx, in, [&](int x, int y, int ch, int lo, int hi)
+                             { out[size_t(channels) * (x + size_t(nx) * y) + ch] = T((lo + hi) / 2); });
+}
+
+/*
+Approximate median. The input is quantised to 2^bits levels of equal width
+between its minimum and maximum, and the counting engine filters the levels
+with a fixed histogram of 2^bits bins. Quantisation preserves order, so the
+level of the result is the level of the exact median, and mapping levels
+back to their centres is off by at most half a level.
+*/
+
+template <int BITS>
+static float mf_quantised(int ny, int nx, int hy, int hx, const float *in, float *out)
+{
+  constexpr int LEVELS = 1 << BITS;
+  const int n = ny * nx;
+  float lo = in[0], hi = in[0];
+#pragma omp parallel for reduction(min : lo) reduction(max : hi)
+  for (int i = 0; i < n; i++)
+  {
+    lo = min(lo, in[i]);
+    hi = max(hi, in[i]);
+  }
+  if (!(lo < hi))
+  {
+    copy(in, in + n, out);
+    return 0;
+  }
+
+  const double step = (double(hi) - lo) / LEVELS;
+  vector<uint16_t> levels(n);
+#pragma omp parallel for
+  for (int i = 0; i < n; i++)
+  {
+    levels[i] = min(LEVELS - 1, int((double(in[i]) - lo) / step));
+  }
+  // centre of level l is lo + (l + 0.5) * step; for even windows the mean of
+  // the centres of the two middle levels
+  mf_counting<BITS>(ny, nx, 1, hy, hx, levels.data(), [&](int x, int y, int, int l0, int l1)
+                    { out[x + nx * y] = lo + ((l0 + l1) * 0.5 + 0.5) * step; });
+  return step / 2;
+}
+
+/*
+Backend selection. Each backend has a cost model: the time per output pixel
+is a calibrated constant times a measure of work that depends on the
+window only,
+
+  small      n^1.5        forgetful selection, n = (2 hy + 1) (2 hx + 1)
+  select     n            nth_element
+  bitset     2 hy + 54    one column of bits per step, plus sorting
+  histogram  hy + 64      nearly constant per pixel
+
+and the backend with the smallest prediction is used. The constants come
+from a microbenchmark; if PPC_MF_CALIBRATION names a file, the constants
+are read from it, or measured once and written to it if it does not exist.
+Otherwise the built-in constants below are used.
+*/
+
+constexpr int BACKENDS = 4;
+static const char *const backend_names[BACKENDS] = {"small", "select", "bitset", "histogram"};
+
+struct CostModel
+{
+  double ns_per_work[BACKENDS];
+};
+
+// measured on 1500 x 1500 random images
+static const CostModel default_cost_model = {{0.28, 20.7, 6.7, 7.5}};
+
+static double backend_work(mf_backend backend, int hy, int hx)
+{
+  const double n = double(2 * hy + 1) * (2 * hx + 1);
+  switch (backend)
+  {
+  case mf_backend::small:
+    return n * sqrt(n);
+  case mf_backend::select:
+    return n;
+  case mf_backend::bitset:
+    return 2 * hy + 54;
+  case mf_backend::histogram:
+    return hy + 64;
+  }
+  return 0;
+}
+
+// runs rank filtering of the area with the given backend; small is run as
+// select, since the small kernels only produce medians
+template <typename Emit>
+static void rank_area(mf_backend backend, int ny, int nx, int hy, int hx, const float *in, Emit emit, const Tile &area)
+{
+  switch (backend)
+  {
+  case mf_backend::small:
+  case mf_backend::select:
+    mf_select(ny, nx, hy, hx, in, emit, area);
+    break;
+  case mf_backend::bitset:
+    mf_bitset(ny, nx, hy, hx, in, emit, area);
+    break;
+  case mf_backend::histogram:
+    mf_histogram(ny, nx, hy, hx, in, emit, area);
+    break;
+  }
+}
+
+static bool small_kernel_exists(int hy, int hx)
+{
+  return 1 <= hy && hy <= SMALL_MAX_H && 1 <= hx && hx <= SMALL_MAX_H;
+}
+
+// times one run of a backend on the interior of a random image
+static double time_backend(mf_backend backend, int hy, int hx)
+{
+  constexpr int SIZE = 384;
+  vector<float> in(SIZE * SIZE), out(SIZE * SIZE);
+  uint32_t state = 1;
+  for (float &v : in)
+  {
+    state = state * 1664525u + 1013904223u;
+    v = (state >> 8) * (1.0f / (1 << 24));
+  }
+  const Tile interior{hy, SIZE - hy, hx, SIZE - hx};
+  auto t0 = chrono::steady_clock::now();
+  if (backend == mf_backend::small)
+  {
+    small_kernels[hy - 1][hx - 1](SIZE, in.data(), out.data(), interior);
+  }
+  else
+  {
+    rank_area(backend, SIZE, SIZE, hy, hx, in.data(), median_to(SIZE, out.data()), interior);
+  }
+  auto t1 = chrono::steady_clock::now();
+  return chrono::duration<double, nano>(t1 - t0).count() / pixels_of(interior);
+}
+
+// the window each backend is measured with, near where it competes with
+// its neighbours
+static const int calibration_window[BACKENDS] = {2, 2, 24, 32};
+
+static CostModel measure_cost_model()
+{
+  CostModel model;
+  for (int b = 0; b < BACKENDS; b++)
+  {
+    const mf_backend backend = mf_backend(b);
+    const int h = calibration_window[b];
+    model.ns_per_work[b] = time_backend(backend, h, h) / backend_work(backend, h, h);
+  }
+  return model;
+}
+
+static bool write_cost_model(const char *path, const CostModel &model)
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+  {
+    return false;
+  }
+  fprintf(f, "ppc-mf-calibration 1\n");
+  for (int b = 0; b < BACKENDS; b++)
+  {
+    fprintf(f, "%s %.6g\n", backend_names[b], model.ns_per_work[b]);
+  }
+  return fclose(f) == 0;
+}
+
+static bool read_cost_model(const char *path, CostModel &model)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    return false;
+  }
+  int version = 0;
+  bool ok = fscanf(f, "ppc-mf-calibration %d", &version) == 1 && version == 1;
+  for (int b = 0; ok && b < BACKENDS; b++)
+  {
+    char name[32];
+    ok = fscanf(f, "%31s %lf", name, &model.ns_per_work[b]) == 2 && strcmp(name, backend_names[b]) == 0;
+  }
+  fclose(f);
+  return ok;
+}
+
+static const CostModel &cost_model()
+{
+  static const CostModel model = []
+  {
+    const char *path = getenv("PPC_MF_CALIBRATION");
+    CostModel m = default_cost_model;
+    if (path && !read_cost_model(path, m))
+    {
+      m = measure_cost_model();
+      write_cost_model(path, m);
+    }
+    return m;
+  }();
+  return model;
+}
+
+bool mf_calibrate(const char *path)
+{
+  return write_cost_model(path, measure_cost_model());
+}
+
+// predicted time of a backend in nanoseconds for `pixels` output pixels
+static double predict_ns(mf_backend backend, long long pixels, int hy, int hx)
+{
+  return cost_model().ns_per_work[int(backend)] * backend_work(backend, hy, hx) * pixels;
+}
+
+static mf_backend choose_backend(long long pixels, int hy, int hx, bool median)
+{
+  mf_backend best = mf_backend::select;
+  for (int b = 0; b < BACKENDS; b++)
+  {
+    const mf_backend backend = mf_backend(b);
+    if (backend == mf_backend::small && !(median && small_kernel_exists(hy, hx)))
+    {
+      continue;
+    }
+    if (predict_ns(backend, pixels, hy, hx) < predict_ns(best, pixels, hy, hx))
+    {
+      best = backend;
+    }
+  }
+  return best;
+}
+
+mf_backend mf_choose_backend(int ny, int nx, int hy, int hx)
+{
+  return choose_backend((long long)ny * nx, hy, hx, true);
+}
+
+/*
+Interior and border. The output pixels of rows [y0, y1) whose windows have
+the full (2 hy + 1) x (2 hx + 1) pixels form one rectangle, the interior,
+which is filtered by kernels that never clamp the window bounds: the small
+kernels, and the fixed-size window copy of the select engine. The rest is
+the border, up to four strips around the interior, which is filtered with
+clamped windows. The two regions are timed separately.
+*/
+
+struct Regions
+{
+  Tile interior;
+  Tile border[4];
+  int strips = 0;
+};
+
+static Regions split_regions(int ny, int nx, int hy, int hx, int y0, int y1)
+{
+  Regions r;
+  const int iy0 = max(y0, hy), iy1 = min(y1, ny - hy);
+  if (iy0 >= iy1 || 2 * hx >= nx)
+  {
+    r.interior = Tile{y0, y0, 0, 0};
+    r.border[r.strips++] = Tile{y0, y1, 0, nx};
+    return r;
+  }
+  r.interior = Tile{iy0, iy1, hx, nx - hx};
+  if (y0 < iy0)
+  {
+    r.border[r.strips++] = Tile{y0, iy0, 0, nx};
+  }
+  if (iy1 < y1)
+  {
+    r.border[r.strips++] = Tile{iy1, y1, 0, nx};
+  }
+  if (hx > 0)
+  {
+    r.border[r.strips++] = Tile{iy0, iy1, 0, hx};
+    r.border[r.strips++] = Tile{iy0, iy1, nx - hx, nx};
+  }
+  return r;
+}
+
+// runs interior(area) on the interior and border(area) on each border strip
+template <typename Interior, typename Border>
+static void filter_regions(const Regions &r, Interior interior, Border border)
+{
+  STATS(long long t0 = stats_clock());
+  if (pixels_of(r.interior) > 0)
+  {
+    interior(r.interior);
+    STATS(median_stats.interior_pixels += pixels_of(r.interior));
+  }
+  STATS(long long t1 = stats_clock(); median_stats.interior_ns += t1 - t0);
+  for (int i = 0; i < r.strips; i++)
+  {
+    if (pixels_of(r.border[i]) > 0)
+    {
+      border(r.border[i]);
+      STATS(median_stats.border_pixels += pixels_of(r.border[i]));
+    }
+  }
+  STATS(median_stats.border_ns += stats_clock() - t1);
+}
+
+// filters the output rows [y0, y1) with the backend predicted to be fastest
+static void mf_rows(int ny, int nx, int hy, int hx, const float *in, float *out, int y0, int y1)
+{
+  const long long pixels = (long long)(y1 - y0) * nx;
+  const mf_backend backend = choose_backend(pixels, hy, hx, true);
+  STATS(median_stats.backend = int(backend));
+  STATS(median_stats.predicted_ns += predict_ns(backend, pixels, hy, hx));
+  filter_regions(
+      split_regions(ny, nx, hy, hx, y0, y1),
+      [&](const Tile &area)
+      {
+        if (backend == mf_backend::small)
+        {
+          small_kernels[hy - 1][hx - 1](nx, in, out, area);
+        }
+        else
+        {
+          rank_area(backend, ny, nx, hy, hx, in, median_to(nx, out), area);
+        }
+      },
+      [&](const Tile &area) { rank_area(backend, ny, nx, hy, hx, in, median_to(nx, out), area); });
+}
+
+void mf(int ny, int nx, int hy, int hx, const float *in, float *out)
+{
+  mf_rows(ny, nx, hy, hx, in, out, 0, ny);
+}
+
+// value of one rank query for a window of n values
+template <typename Select, typename Sum>
+static inline float rank_value(const rank_query &query, int n, Select &&select, Sum &&sum)
+{
+  if (query.kind == rank_query::quantile)
+  {
+    const double p = min(1.0f, max(0.0f, query.q)) * double(n - 1);
+    const int k = int(p);
+    double v = select(k);
+    if (p > k)
+    {
+      v += (p - k) * (select(k + 1) - v);
+    }
+    return v;
+  }
+  // trimmed mean of the ranks left after dropping d on each side; q is
+  // clamped to [0, 0.5) so that at least one rank is kept
+  const double q = min(0.5, max(0.0, double(query.q)));
+  const int d = min(int(q * n), (n - 1) / 2);
+  return sum(d, n - d) / (n - 2 * d);
+}
+
+void rank_filter(int ny, int nx, int hy, int hx, int count, const rank_query *queries, const float *in,
+                 float *const *out)
+{
+  auto emit = [=](int x, int y, int n, auto &&select, auto &&sum)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      out[i][x + nx * y] = rank_value(queries[i], n, select, sum);
+    }
+  };
+  const mf_backend backend = choose_backend((long long)ny * nx, hy, hx, false);
+  STATS(median_stats.backend = int(backend));
+  STATS(median_stats.predicted_ns += predict_ns(backend, (long long)ny * nx, hy, hx));
+  auto run = [&](const Tile &area) { rank_area(backend, ny, nx, hy, hx, in, emit, area); };
+  filter_regions(split_regions(ny, nx, hy, hx, 0, ny), run, run);
+}
+
+/*
+Streaming. The image is filtered in bands of output rows; for each band only
+its input rows and the hy rows of halo on both sides are held in memory, and
+the halo shared with the next band is kept instead of read again. Within the
+band buffer, windows are cut exactly where they are cut in the full image,
+so every band is an ordinary call of mf_rows.
+*/
+
+constexpr int STREAM_MIN_ROWS = 64;
+
+void mf_stream(int ny, int nx, int hy, int hx, const mf_reader &read, const mf_writer &write)
+{
+  const int band = max(STREAM_MIN_ROWS, 2 * hy);
+  vector<float> in(size_t(band + 2 * hy) * nx), out(in.size());
+
+  // image rows [a, b) are in `in`, from its first row on
+  int a = 0, b = 0;
+  for (int y0 = 0; y0 < ny; y0 += band)
+  {
+    const int y1 = min(ny, y0 + band);
+    const int na = max(0, y0 - hy), nb = min(ny, y1 + hy);
+    if (na < b)
+    {
+      memmove(in.data(), in.data() + size_t(na - a) * nx, size_t(b - na) * nx * sizeof(float));
+    }
+    else
+    {
+      b = na;
+    }
+    read(b, nb - b, in.data() + size_t(b - na) * nx);
+    a = na;
+    b = nb;
+
+    mf_rows(b - a, nx, hy, hx, in.data(), out.data(), y0 - a, y1 - a);
+    write(y0, y1 - y0, out.data() + size_t(y0 - a) * nx);
+  }
+}
+
+// page-aligned part of [begin, end) of a mapping, for madvise
+static void release_pages(char *base, size_t begin, size_t end)
+{
+  const size_t page = sysconf(_SC_PAGESIZE);
+  begin = (begin + page - 1) / page * page;
+  end = end / page * page;
+  if (begin < end)
+  {
+    madvise(base + begin, end - begin, MADV_DONTNEED);
+  }
+}
+
+bool mf_file(int ny, int nx, int hy, int hx, const char *in_path, const char *out_path)
+{
+  const size_t row_bytes = size_t(nx) * sizeof(float), bytes = row_bytes * ny;
+
+  int in_fd = open(in_path, O_RDONLY);
+  if (in_fd < 0)
+  {
+    return false;
+  }
+  struct stat st;
+  if (fstat(in_fd, &st) != 0 || size_t(st.st_size) < bytes)
+  {
+    close(in_fd);
+    return false;
+  }
+  int out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0 || ftruncate(out_fd, bytes) != 0)
+  {
+    close(in_fd);
+    if (out_fd >= 0)
+    {
+      close(out_fd);
+    }
+    return false;
+  }
+  void *in_map = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, in_fd, 0);
+  void *out_map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+  close(in_fd);
+  close(out_fd);
+  if (in_map == MAP_FAILED || out_map == MAP_FAILED)
+  {
+    if (in_map != MAP_FAILED)
+    {
+      munmap(in_map, bytes);
+    }
+    if (out_map != MAP_FAILED)
+    {
+      munmap(out_map, bytes);
+    }
+    return false;
+  }
+
+  // rows are copied out of and into the mappings once, so their pages are
+  // released as soon as they are done to keep the resident size bounded
+  char *src = static_cast<char *>(in_map), *dst = static_cast<char *>(out_map);
+  madvise(src, bytes, MADV_SEQUENTIAL);
+  mf_stream(ny, nx, hy, hx, [&](int y, int rows, float *data)
+            {
+              memcpy(data, src + y * row_bytes, rows * row_bytes);
+              release_pages(src, 0, (y + rows) * row_bytes);
+            },
+            [&](int y, int rows, const float *data)
+            {
+              memcpy(dst + y * row_bytes, data, rows * row_bytes);
+              release_pages(dst, 0, y * row_bytes);
+            });
+
+  bool ok = msync(out_map, bytes, MS_SYNC) == 0;
+  munmap(in_map, bytes);
+  munmap(out_map, bytes);
+  return ok;
+}
+
+void mf(int ny, int nx, int channels, int hy, int hx, const uint8_t *in, uint8_t *out)
+{
+  mf_counting(ny, nx, channels, hy, hx, in, out);
+}
+
+void mf(int ny, int nx, int channels, int hy, int hx, const uint16_t *in, uint16_t *out)
+{
+  mf_counting(ny, nx, channels, hy, hx, in, out);
+}
+
+// floats have no small value range to count, so every channel goes through
+// the single plane engines
+void mf(int ny, int nx, int channels, int hy, int hx, const float *in, float *out)
+{
+  if (channels == 1)
+  {
+    mf(ny, nx, hy, hx, in, out);
+    return;
+  }
+  const size_t n = size_t(ny) * nx;
+  vector<float> plane_in(n), plane_out(n);
+  for (int ch = 0; ch < channels; ch++)
+  {
+#pragma omp parallel for
+    for (size_t i = 0; i < n; i++)
+    {
+      plane_in[i] = in[i * channels + ch];
+    }
+    mf(ny, nx, hy, hx, plane_in.data(), plane_out.data());
+#pragma omp parallel for
+    for (size_t i = 0; i < n; i++)
+    {
+      out[i * channels + ch] = plane_out[i];
+    }
+  }
+}
+
+float mf_approx(int ny, int nx, int hy, int hx, int bits, const float *in, float *out)
+{
+  if (bits <= 8)
+  {
+    return mf_quantised<8>(ny, nx, hy, hx, in, out);
   }
-}
\ No newline at end of file
+  return mf_quantised<12>(ny, nx, hy, hx, in, out);
+}
@@ -1,5 +1,7 @@
+import os
 from typing import Optional
 import ppcgrader.config
+from ppcgrader.compiler import Compiler
 
 
 class Config(ppcgrader.config.Config):
@@ -9,6 +11,13 @@ class Config(ppcgrader.config.Config):
                          gpu=gpu,
                          openmp=openmp)
 
+    def common_flags(self, compiler: Compiler) -> Compiler:
+        compiler = super().common_flags(compiler)
+        # PPC_STATS=1 enables the instrumentation of psort, reported as extra perf_so_* statistics
+        if os.environ.get('PPC_STATS'):
+            compiler = compiler.add_definition('PPC_STATS')
+        return compiler
+
     def parse_output(self, output):
         input_data = {
             "n": None,
@@ -45,7 +54,11 @@ class Config(ppcgrader.config.Config):
                 time = int(splitted[1]) / 1e9
                 statistics[splitted[0]] = int(splitted[1])
             elif splitted[0].startswith('perf_'):
-                statistics[splitted[0]] = int(splitted[1])
+                # the scaling sweep reports ratios
+                try:
+                    statistics[splitted[0]] = int(splitted[1])
+                except ValueError:
+                    statistics[splitted[0]] = float(splitted[1])
             elif splitted[0] == 'n':
                 input_data['n'] = int(splitted[1])
             elif splitted[0] == 'input':
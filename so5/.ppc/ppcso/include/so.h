@@ -1,5 +1,52 @@
 #pragma once
 
+#include <cstdint>
+
 typedef unsigned long long data_t;
 
+// Sorting algorithms that psort can use.
+enum class sort_backend {
+    native,     // the algorithm of the exercise: mergesort in so4, quicksort in so5
+    radix,      // parallel LSD radix sort
+    samplesort, // parallel samplesort with equality buckets
+    network,    // the sorting network base case alone, on one thread
+    inplace,    // parallel in-place MSD radix sort, without a buffer
+};
+
 void psort(int n, data_t *data);
+void psort(int n, data_t *data, sort_backend backend);
+
+// A 16-byte payload.
+struct payload16 {
+    std::uint64_t word[2];
+};
+
+// Sorts keys as psort does, moving values[i] along with keys[i]; equal keys
+// keep their relative order. The parallel radix sort does the work.
+void psort_pairs(int n, data_t *keys, std::uint32_t *values);
+void psort_pairs(int n, data_t *keys, std::uint64_t *values);
+void psort_pairs(int n, data_t *keys, payload16 *values);
+
+// Sets index to the permutation that sorts keys, with equal keys in the order
+// of their positions; keys are not changed.
+void argsort(int n, const data_t *keys, int *index);
+
+// Sorts the keys of the binary file input into the file output, using about
+// memory bytes of buffers; chunks of the input are sorted by psort with the
+// backend, and then merged. Returns false if a file operation fails, or if
+// output is the input file, which is then left as it is.
+bool psort_file(const char *input, const char *output, long long memory, sort_backend backend);
+
+#ifdef PPC_STATS
+// Instrumentation of psort, accumulated over calls. Only available when
+// compiled with PPC_STATS.
+struct SortStats {
+    long long runs;            // presorted runs used
+    long long descending_runs; // of which reversed
+    long long run_keys;        // keys in the runs used
+    long long detect_ns;       // looking for runs
+    long long merge_ns;        // merging the runs
+};
+
+extern SortStats sort_stats;
+#endif
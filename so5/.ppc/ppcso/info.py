@@ -80,6 +80,10 @@ def explain_web(raw: dict):
     <p>It seems that the output is not in the correct order.</p>
 {% elif oe.type == 2 %}
     <p>It seems that the output contains the wrong set of numbers.</p>
+{% elif oe.type == 3 %}
+    <p>It seems that the payloads or the permutation do not match the sorted keys, or equal keys are not in their original order.</p>
+{% elif oe.type == 4 %}
+    <p>It seems that the in-place sort allocated memory in proportion to the input.</p>
 {% endif %}
 """
     return render_explain_web(templ_basic, raw)
@@ -119,5 +123,9 @@ def explain_terminal(r, color=False):
         result += 'It seems that the output is not in the correct order.\n'
     elif error_type == 2:
         result += 'It seems that the output contains the wrong set of numbers.\n'
+    elif error_type == 3:
+        result += 'It seems that the payloads or the permutation do not match the sorted keys, or equal keys are not in their original order.\n'
+    elif error_type == 4:
+        result += 'It seems that the in-place sort allocated memory in proportion to the input.\n'
 
     return result
@@ -3,6 +3,7 @@
 #include <cassert>
 #include <chrono>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
@@ -11,7 +12,9 @@
 #include <memory>
 #include <random>
 #include <sstream>
+#include <string>
 #include <type_traits>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #ifndef __NVCC__
@@ -163,6 +166,193 @@ input generate_raw_input(std::ifstream &input_file) {
     return {(int)input.size(), input};
 }
 
+#ifdef PPC_STATS
+static void print_stats(ppc::fdostream &stream) {
+    stream
+        << "perf_so_runs\t" << sort_stats.runs << '\n'
+        << "perf_so_descending_runs\t" << sort_stats.descending_runs << '\n'
+        << "perf_so_run_keys\t" << sort_stats.run_keys << '\n'
+        << "perf_so_detect_ns\t" << sort_stats.detect_ns << '\n'
+        << "perf_so_merge_ns\t" << sort_stats.merge_ns << '\n';
+}
+#endif
+
+#ifndef __NVCC__
+// Times psort on a copy of the input at every thread count of the sweep:
+// the powers of two below the maximum, and the maximum. Speedup and parallel efficiency are relative to one thread; bandwidth is
+// the effective one, with every key read and written once.
+static void run_sweep(ppc::fdostream &stream, const input &input, sort_backend backend) {
+    const int max_threads = omp_get_max_threads();
+    std::vector<data_t> data(input.n);
+    double single_ns = 0;
+    for (int threads = 1;; threads = std::min(2 * threads, max_threads)) {
+        std::copy(input.data.begin(), input.data.end(), data.begin());
+        omp_set_num_threads(threads);
+        double start = omp_get_wtime();
+        psort(input.n, data.data(), backend);
+        double ns = (omp_get_wtime() - start) * 1e9;
+        if (threads == 1) {
+            single_ns = ns;
+        }
+        stream
+            << "perf_sweep_t" << threads << "_ns\t" << (long long)ns << '\n'
+            << "perf_sweep_t" << threads << "_speedup\t" << single_ns / ns << '\n'
+            << "perf_sweep_t" << threads << "_efficiency\t" << single_ns / ns / threads << '\n'
+            << "perf_sweep_t" << threads << "_bandwidth_gbs\t" << 2.0 * input.n * sizeof(data_t) / ns << '\n';
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    omp_set_num_threads(max_threads);
+}
+#endif
+
+static bool parse_backend(const std::string &name, sort_backend &backend) {
+    if (name == "native")
+        backend = sort_backend::native;
+    else if (name == "radix")
+        backend = sort_backend::radix;
+    else if (name == "samplesort")
+        backend = sort_backend::samplesort;
+    else if (name == "network")
+        backend = sort_backend::network;
+    else if (name == "inplace")
+        backend = sort_backend::inplace;
+    else
+        return false;
+    return true;
+}
+
+// Arrays smaller than this are too small to see the memory of the in-place backend.
+constexpr int IN_PLACE_CHECK_MIN = 1 << 20;
+
+// Memory that the process touches for the first time, from the minor page
+// faults, and the growth of its peak resident set, around one sort.
+struct memory_use {
+    long long faults = 0;
+    long long fault_kb = 0;
+    long long rss_growth_kb = 0;
+};
+
+static rusage usage_now() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage;
+}
+
+static memory_use memory_between(const rusage &before, const rusage &after) {
+    memory_use use;
+    use.faults = after.ru_minflt - before.ru_minflt;
+    use.fault_kb = use.faults * (sysconf(_SC_PAGESIZE) / 1024);
+    use.rss_growth_kb = after.ru_maxrss - before.ru_maxrss;
+    return use;
+}
+
+// What the test sorts: bare keys, keys with payloads, a permutation, or a file.
+enum class sort_mode {
+    keys,
+    pairs,
+    argsort,
+    external,
+};
+
+// Payload of the key at position i: the position, followed by words derived
+// from it, so that a payload moved only in part is detected.
+template <typename V>
+static V payload_of(int i) {
+    std::uint32_t words[sizeof(V) / 4];
+    words[0] = i;
+    for (size_t k = 1; k < sizeof(V) / 4; k++) {
+        words[k] = (std::uint32_t)(i + k) * 2654435761u;
+    }
+    V value;
+    std::memcpy(&value, words, sizeof(V));
+    return value;
+}
+
+// Position of the key that a payload came with, or -1 if it is not intact.
+template <typename V>
+static int payload_origin(const V &value, int n) {
+    std::uint32_t i;
+    std::memcpy(&i, &value, 4);
+    if (i >= (std::uint32_t)n) {
+        return -1;
+    }
+    V expected = payload_of<V>(i);
+    return std::memcmp(&expected, &value, sizeof(V)) == 0 ? (int)i : -1;
+}
+
+template <typename V>
+static void time_pairs(ppc::perf &timer, input &input, std::vector<int> &origin) {
+    std::unique_ptr<V[]> values(new V[input.n]);
+    for (int i = 0; i < input.n; i++) {
+        values[i] = payload_of<V>(i);
+    }
+    timer.start();
+    psort_pairs(input.n, input.data.data(), values.get());
+    timer.stop();
+    origin.resize(input.n);
+    for (int i = 0; i < input.n; i++) {
+        origin[i] = payload_origin(values[i], input.n);
+    }
+}
+
+// Sorts the keys through files: writes them to a temporary file, times
+// psort_file, and reads the output back. Returns false if a file operation fails.
+static bool time_external(ppc::perf &timer, input &input, long long memory, sort_backend backend) {
+    const char *dir = std::getenv("TMPDIR");
+    std::string path = std::string(dir ? dir : "/tmp") + "/ppc-so-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        return false;
+    }
+    std::string output_path = path + ".out";
+    FILE *file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+    bool ok = std::fwrite(input.data.data(), sizeof(data_t), input.n, file) == (size_t)input.n;
+    ok = std::fclose(file) == 0 && ok;
+    // sorting a file onto itself is refused, and the input is left as it was
+    if (ok) {
+        ok = !psort_file(path.c_str(), path.c_str(), memory, backend);
+    }
+    if (ok) {
+        timer.start();
+        ok = psort_file(path.c_str(), output_path.c_str(), memory, backend);
+        timer.stop();
+    }
+    if (ok) {
+        file = std::fopen(output_path.c_str(), "rb");
+        ok = file && std::fread(input.data.data(), sizeof(data_t), input.n, file) == (size_t)input.n &&
+             std::fgetc(file) == EOF;
+        if (file) {
+            std::fclose(file);
+        }
+    }
+    unlink(path.c_str());
+    unlink(output_path.c_str());
+    return ok;
+}
+
+// Whether the output keys came from the positions origin, in a stable order.
+static bool check_origin(const std::vector<data_t> &original, const input &output, const std::vector<int> &origin) {
+    std::vector<int> seen(output.n);
+    for (int i = 0; i < output.n; i++) {
+        int j = origin[i];
+        if (j < 0 || j >= output.n || seen[j] || original[j] != output.data[i]) {
+            return false;
+        }
+        if (i > 0 && output.data[i] == output.data[i - 1] && j < origin[i - 1]) {
+            return false;
+        }
+        seen[j] = 1;
+    }
+    return true;
+}
+
 int main(int argc, const char **argv) {
     const char *ppc_output = std::getenv("PPC_OUTPUT");
     int ppc_output_fd = 0;
@@ -212,7 +402,12 @@ int main(int argc, const char **argv) {
         return 3;
     }
 
-    if (input_file >> input_type) {
+    sort_backend backend = sort_backend::native;
+    sort_mode mode = sort_mode::keys;
+    int payload_bytes = 0;
+    long long memory = 0;
+    bool sweep = false;
+    while (input_file >> input_type) {
         if (input_type == "threads") {
 #ifndef __NVCC__
             size_t thread_count;
@@ -223,6 +418,32 @@ int main(int argc, const char **argv) {
             std::cerr << "Can't set the number of threads when running on GPU" << std::endl;
             return 3;
 #endif
+        } else if (input_type == "backend") {
+            std::string name;
+            CHECK_READ(input_file >> name);
+            if (!parse_backend(name, backend)) {
+                std::cerr << "Unknown backend: " << name << std::endl;
+                return 3;
+            }
+        } else if (input_type == "payload") {
+            CHECK_READ(input_file >> payload_bytes);
+            if (payload_bytes != 4 && payload_bytes != 8 && payload_bytes != 16) {
+                std::cerr << "Unsupported payload size: " << payload_bytes << std::endl;
+                return 3;
+            }
+            mode = sort_mode::pairs;
+        } else if (input_type == "argsort") {
+            mode = sort_mode::argsort;
+        } else if (input_type == "sweep") {
+#ifndef __NVCC__
+            sweep = true;
+#else
+            std::cerr << "Can't sweep the number of threads when running on GPU" << std::endl;
+            return 3;
+#endif
+        } else if (input_type == "external") {
+            CHECK_READ(input_file >> memory);
+            mode = sort_mode::external;
         } else {
             std::cerr << "Unknown input: " << input_type << std::endl;
             return 3;
@@ -236,15 +457,63 @@ int main(int argc, const char **argv) {
 
     bool small = input.n <= 200;
     std::vector<data_t> original;
-    if (small)
+    if (small || (test && (mode == sort_mode::pairs || mode == sort_mode::argsort)))
         original = input.data;
+    // positions in the input of the sorted keys, for pairs and argsort
+    std::vector<int> origin;
+
+#ifndef __NVCC__
+    if (sweep) {
+        run_sweep(*stream, input, backend);
+    }
+#endif
 
     ppc::setup_cuda_device();
     ppc::perf timer;
-    timer.start();
-    psort(input.n, input.data.data());
-    timer.stop();
+    memory_use used;
+#ifdef PPC_STATS
+    sort_stats = {};
+#endif
+    if (mode == sort_mode::pairs) {
+        if (payload_bytes == 4)
+            time_pairs<std::uint32_t>(timer, input, origin);
+        else if (payload_bytes == 8)
+            time_pairs<std::uint64_t>(timer, input, origin);
+        else
+            time_pairs<payload16>(timer, input, origin);
+    } else if (mode == sort_mode::argsort) {
+        origin.resize(input.n);
+        timer.start();
+        argsort(input.n, input.data.data(), origin.data());
+        timer.stop();
+        // the keys in the order of the permutation
+        std::vector<data_t> sorted(input.n);
+        for (int i = 0; i < input.n; i++) {
+            int j = origin[i];
+            sorted[i] = 0 <= j && j < input.n ? input.data[j] : 0;
+        }
+        input.data.swap(sorted);
+    } else if (mode == sort_mode::external) {
+        if (!time_external(timer, input, memory, backend)) {
+            std::cerr << "External sort failed" << std::endl;
+            return 3;
+        }
+    } else {
+        rusage before = usage_now();
+        timer.start();
+        psort(input.n, input.data.data(), backend);
+        timer.stop();
+        used = memory_between(before, usage_now());
+    }
     timer.print_to(*stream);
+    if (mode == sort_mode::keys) {
+        *stream << "perf_minor_faults\t" << used.faults << '\n'
+                << "perf_fault_kb\t" << used.fault_kb << '\n'
+                << "perf_rss_growth_kb\t" << used.rss_growth_kb << '\n';
+    }
+#ifdef PPC_STATS
+    print_stats(*stream);
+#endif
     ppc::reset_cuda_device();
 
     if (test) {
@@ -260,6 +529,16 @@ int main(int argc, const char **argv) {
                 }
             }
         }
+        if (!error_type && !origin.empty() && !check_origin(original, input, origin)) {
+            error_type = 3;
+        }
+        // the in-place backend may touch a quarter of the array in new memory,
+        // which leaves room for its counters and thread stacks
+        if (!error_type && backend == sort_backend::inplace && mode == sort_mode::keys &&
+            input.n >= IN_PLACE_CHECK_MIN &&
+            used.fault_kb * 1024 > (long long)input.n * (long long)sizeof(data_t) / 4) {
+            error_type = 4;
+        }
 
         if (error_type) {
             *stream << "error_type\t" << error_type << "\n";
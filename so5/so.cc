@@ -1,58 +1,1962 @@
+#include "so.h"
 #include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <omp.h>
-#include <cmath>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-typedef unsigned long long data_t;
+#ifdef PPC_STATS
+#include <chrono>
 
-void quickSort(int thread, int n, data_t *data)
+SortStats sort_stats;
+
+static long long stats_clock()
 {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
 
-    if (n < 2)
+#define STATS(x) x
+#else
+#define STATS(x)
+#endif
+
+// an array of n elements that are not initialised, freed with its owner
+template <typename T>
+class Array
+{
+  public:
+    explicit Array(long long n = 0) : p(n > 0 ? new T[n] : nullptr) {}
+    Array(const Array &) = delete;
+    Array &operator=(const Array &) = delete;
+    ~Array() { delete[] p; }
+
+    T *get() const { return p; }
+    T &operator[](long long i) const { return p[i]; }
+
+    void reset(long long n)
+    {
+        T *q = n > 0 ? new T[n] : nullptr;
+        delete[] p;
+        p = q;
+    }
+    void swap(Array &other) { std::swap(p, other.p); }
+
+  private:
+    T *p;
+};
+
+/*
+Sorting network base case. Blocks of up to NETWORK_MAX keys are sorted by a
+bitonic sorting network on SIMD vectors: compare-exchanges between keys at
+least a vector apart are a min and a max of two vectors, and those within a
+vector are a min and a max with a permuted copy of the vector, blended by a
+constant mask, so no step depends on the data. Sorted sequences are merged
+one vector at a time: the next vector comes from the input whose next key is
+smaller, a bitonic network merges it with the largest vector so far, and the
+smaller half goes out. Without AVX2, the base case is std::sort and
+std::merge.
+*/
+
+constexpr int NETWORK_MAX = 256;
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+// GCC vector extensions, which need no intrinsics and compile to AVX-512 or
+// AVX2 instructions
+struct Simd
+{
+#if defined(__AVX512F__)
+    static constexpr int LANES = 8;
+#else
+    static constexpr int LANES = 4;
+#endif
+    static constexpr unsigned ALL = (1u << LANES) - 1;
+    typedef data_t vec __attribute__((vector_size(LANES * sizeof(data_t))));
+    typedef long long lanes __attribute__((vector_size(LANES * sizeof(data_t))));
+
+    // lane l holds l, and bit l
+#if defined(__AVX512F__)
+    static constexpr lanes LANE = {0, 1, 2, 3, 4, 5, 6, 7};
+    static constexpr lanes BIT = {1, 2, 4, 8, 16, 32, 64, 128};
+#else
+    static constexpr lanes LANE = {0, 1, 2, 3};
+    static constexpr lanes BIT = {1, 2, 4, 8};
+#endif
+
+    static vec load(const data_t *p)
+    {
+        vec v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    static void store(data_t *p, vec v) { std::memcpy(p, &v, sizeof(v)); }
+    static vec min(vec a, vec b) { return a < b ? a : b; }
+    static vec max(vec a, vec b) { return a < b ? b : a; }
+
+    // lane l of the result is lane l ^ j of v
+    static vec swapLanes(vec v, int j) { return __builtin_shuffle(v, LANE ^ j); }
+    static vec reverse(vec v) { return __builtin_shuffle(v, LANE ^ (LANES - 1)); }
+
+    // lane l of a where bit l of mask is set, of b elsewhere
+    static vec select(unsigned mask, vec a, vec b) { return (BIT & mask) != 0 ? a : b; }
+};
+
+typedef Simd::vec vec;
+constexpr int LANES = Simd::LANES;
+
+// lanes l with l & j == 0, which keep the smaller key of a compare-exchange
+static constexpr unsigned lowerLanes(int j)
+{
+    unsigned mask = 0;
+    for (int l = 0; l < LANES; l++)
+    {
+        mask |= (l & j) == 0 ? 1u << l : 0;
+    }
+    return mask;
+}
+
+// lanes l with l & s != 0, for s < LANES
+static constexpr unsigned descendingLanes(int s)
+{
+    unsigned mask = 0;
+    for (int l = 0; l < LANES; l++)
+    {
+        mask |= (l & s) != 0 ? 1u << l : 0;
+    }
+    return mask;
+}
+
+// compare-exchanges lane l of v with lane l ^ j; lanes in descending set go the other way
+static inline vec exchangeLanes(vec v, int j, unsigned descending)
+{
+    vec p = Simd::swapLanes(v, j);
+    return Simd::select(lowerLanes(j) ^ descending, Simd::min(v, p), Simd::max(v, p));
+}
+
+// sorts keys[0, m) for a power of two m with LANES <= m <= NETWORK_MAX
+static void bitonicSort(int m, data_t *keys)
+{
+    for (int s = 2; s <= m; s *= 2)
+    {
+        for (int j = s / 2; j > 0; j /= 2)
+        {
+            for (int i = 0; i < m; i += LANES)
+            {
+                // key k of a bitonic sequence of length s goes down if k & s
+                if (j >= LANES)
+                {
+                    if (i & j)
+                    {
+                        continue;
+                    }
+                    vec a = Simd::load(keys + i), b = Simd::load(keys + i + j);
+                    bool descending = i & s;
+                    Simd::store(keys + i, descending ? Simd::max(a, b) : Simd::min(a, b));
+                    Simd::store(keys + i + j, descending ? Simd::min(a, b) : Simd::max(a, b));
+                }
+                else
+                {
+                    unsigned descending = s >= LANES ? ((i & s) ? Simd::ALL : 0) : descendingLanes(s);
+                    Simd::store(keys + i, exchangeLanes(Simd::load(keys + i), j, descending));
+                }
+            }
+        }
+    }
+}
+
+// x and y sorted: x gets the smallest LANES keys of both, y the largest, sorted
+static inline void mergeVectors(vec &x, vec &y)
+{
+    vec r = Simd::reverse(y);
+    vec lo = Simd::min(x, r), hi = Simd::max(x, r);
+    for (int j = LANES / 2; j > 0; j /= 2)
+    {
+        lo = exchangeLanes(lo, j, 0);
+        hi = exchangeLanes(hi, j, 0);
+    }
+    x = lo;
+    y = hi;
+}
+
+// sorts from[0, m) to to[0, m) for m <= NETWORK_MAX; from and to may be the same
+static void sortBlock(int m, const data_t *from, data_t *to)
+{
+    if (m == NETWORK_MAX)
+    {
+        if (from != to)
+        {
+            std::copy(from, from + m, to);
+        }
+        bitonicSort(m, to);
         return;
-    if (thread <= 0)
+    }
+    int size = LANES;
+    while (size < m)
+    {
+        size *= 2;
+    }
+    alignas(64) data_t block[NETWORK_MAX];
+    std::copy(from, from + m, block);
+    // padding sorts after all keys
+    std::fill(block + m, block + size, ~data_t(0));
+    bitonicSort(size, block);
+    std::copy(block, block + m, to);
+}
+
+// merges sorted a and b to out
+static void vectorMerge(const data_t *a, int na, const data_t *b, int nb, data_t *out)
+{
+    if (na < LANES || nb < LANES)
     {
-        std::sort(data, data + n);
+        std::merge(a, a + na, b, b + nb, out);
         return;
     }
+    vec x = Simd::load(a), y = Simd::load(b);
+    int i = LANES, j = LANES;
+    mergeVectors(x, y);
+    Simd::store(out, x);
+    out += LANES;
+    while (i + LANES <= na && j + LANES <= nb)
+    {
+        if (a[i] < b[j])
+        {
+            x = Simd::load(a + i);
+            i += LANES;
+        }
+        else
+        {
+            x = Simd::load(b + j);
+            j += LANES;
+        }
+        mergeVectors(x, y);
+        Simd::store(out, x);
+        out += LANES;
+    }
+    // y and the short rest of one input, then the other input
+    data_t last[LANES], rest[2 * LANES];
+    Simd::store(last, y);
+    if (i + LANES > na)
+    {
+        int r = std::merge(last, last + LANES, a + i, a + na, rest) - rest;
+        std::merge(rest, rest + r, b + j, b + nb, out);
+    }
+    else
+    {
+        int r = std::merge(last, last + LANES, b + j, b + nb, rest) - rest;
+        std::merge(a + i, a + na, rest, rest + r, out);
+    }
+}
+
+#else
+
+static void sortBlock(int m, const data_t *from, data_t *to)
+{
+    if (from != to)
+    {
+        std::copy(from, from + m, to);
+    }
+    std::sort(to, to + m);
+}
 
-    // choosing a better pivot
-    data_t p1 = data[n / 2];
-    data_t p2 = data[0];
-    data_t p3 = data[n - 1];
-    data_t max = std::max(p2, p3);
-    data_t pivot = p1 + p2 + p3 - std::max(p1, max) - std::min(p1, max);
+static void vectorMerge(const data_t *a, int na, const data_t *b, int nb, data_t *out)
+{
+    std::merge(a, a + na, b, b + nb, out);
+}
 
-    data_t *left = data;
-    data_t *right = data + n - 1;
+#endif
 
-    while (left <= right)
+// sorts data[0, n) with blocks and merges, using buffer[0, n) as scratch
+// space; the result is in buffer if toBuffer, and in data otherwise
+static void networkSort(int n, data_t *data, data_t *buffer, bool toBuffer)
+{
+    int levels = 0;
+    for (long long w = NETWORK_MAX; w < n; w *= 2)
+    {
+        levels++;
+    }
+    // every level of merges moves the keys to the other array
+    data_t *from = levels % 2 == toBuffer ? data : buffer;
+    data_t *to = from == data ? buffer : data;
+    for (int i = 0; i < n; i += NETWORK_MAX)
+    {
+        sortBlock(std::min(NETWORK_MAX, n - i), data + i, from + i);
+    }
+    for (long long w = NETWORK_MAX; w < n; w *= 2)
     {
-        while (*left < pivot)
-            left++;
-        while (*right > pivot)
-            right--;
-        if (left <= right)
+        for (long long i = 0; i < n; i += 2 * w)
         {
-            data_t temp = *left;
-            *left = *right;
-            *right = temp;
-            left++;
-            right--;
+            int na = std::min<long long>(w, n - i), nb = std::min<long long>(w, n - i - na);
+            vectorMerge(from + i, na, from + i + na, nb, to + i);
         }
+        std::swap(from, to);
     }
-#pragma omp task shared(data)
-    quickSort(thread - 1, right - data + 1, data);
-#pragma omp task shared(data)
-    quickSort(thread - 1, n - (left - data), left);
 }
 
-void psort(int n, data_t *data)
+/*
+Quicksort with parallel three-way partitioning. The pivot is the median of
+an evenly spaced sample, and every partition splits the keys into those
+less than, equal to and greater than the pivot; the equal keys are in
+their final place, so duplicates and constant runs cost one pass. Large
+subproblems are partitioned in parallel: the array is cut into one block
+per thread, each block task counts its three classes, the counts give
+every block its output offsets in each class, and the blocks are scattered
+to a scratch buffer and copied back. Smaller subproblems are partitioned
+serially in place. The two sides are sorted by new tasks until they are
+below the leaf size, which depends on the input size and thread count, so
+that a skewed split keeps splitting its large side instead of running out
+of task depth.
+*/
+
+constexpr int PIVOT_SAMPLE = 63;
+constexpr int PARALLEL_PARTITION_MIN = 1 << 17;
+constexpr int LEAF_MIN = 1 << 14;
+
+// median of PIVOT_SAMPLE evenly spaced keys
+static data_t samplePivot(int n, const data_t *data)
+{
+    data_t sample[PIVOT_SAMPLE];
+    for (int k = 0; k < PIVOT_SAMPLE; k++)
+    {
+        sample[k] = data[(long long)n * (2 * k + 1) / (2 * PIVOT_SAMPLE)];
+    }
+    sortBlock(PIVOT_SAMPLE, sample, sample);
+    return sample[PIVOT_SAMPLE / 2];
+}
+
+// 0, 1 or 2 for keys less than, equal to or greater than the pivot
+static inline int classify(data_t x, data_t pivot)
+{
+    return (x >= pivot) + (x > pivot);
+}
+
+// three-way partition of data with the scratch buffer; sets sizes[0, 2) to
+// the sizes of the first two classes
+static void parallelPartition(int n, data_t *data, data_t *buffer, data_t pivot, int *sizes)
+{
+    const int blocks = omp_get_max_threads();
+    // offset[b * 3 + c]: where block b scatters class c
+    Array<int> offset(blocks * 3);
+    auto begin = [&](int b) { return (int)((long long)n * b / blocks); };
+
+#pragma omp taskloop shared(offset)
+    for (int b = 0; b < blocks; b++)
+    {
+        int *count = &offset[b * 3];
+        std::fill(count, count + 3, 0);
+        for (int i = begin(b); i < begin(b + 1); i++)
+        {
+            count[classify(data[i], pivot)]++;
+        }
+    }
+
+    int sum = 0;
+    sizes[0] = sizes[1] = 0;
+    for (int c = 0; c < 3; c++)
+    {
+        for (int b = 0; b < blocks; b++)
+        {
+            int t = offset[b * 3 + c];
+            offset[b * 3 + c] = sum;
+            sum += t;
+            if (c < 2)
+            {
+                sizes[c] += t;
+            }
+        }
+    }
+
+#pragma omp taskloop shared(offset)
+    for (int b = 0; b < blocks; b++)
+    {
+        int *out = &offset[b * 3];
+        for (int i = begin(b); i < begin(b + 1); i++)
+        {
+            data_t x = data[i];
+            buffer[out[classify(x, pivot)]++] = x;
+        }
+    }
+#pragma omp taskloop
+    for (int b = 0; b < blocks; b++)
+    {
+        std::copy(buffer + begin(b), buffer + begin(b + 1), data + begin(b));
+    }
+}
+
+// serial three-way partition in place; sets sizes[0, 2) to the sizes of the
+// first two classes
+static void serialPartition(int n, data_t *data, data_t pivot, int *sizes)
+{
+    // data[0, less) < pivot, data[less, i) == pivot, data[greater, n) > pivot
+    int less = 0, i = 0, greater = n;
+    while (i < greater)
+    {
+        if (data[i] < pivot)
+        {
+            std::swap(data[less++], data[i++]);
+        }
+        else if (data[i] > pivot)
+        {
+            std::swap(data[i], data[--greater]);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    sizes[0] = less;
+    sizes[1] = greater - less;
+}
+
+// quicksort of a leaf, down to blocks for the sorting network; after depth
+// levels of poor splits the rest is heap sorted, as in introsort
+static void serialQuickSort(int n, data_t *data, int depth)
+{
+    while (n > NETWORK_MAX)
+    {
+        if (depth-- == 0)
+        {
+            std::make_heap(data, data + n);
+            std::sort_heap(data, data + n);
+            return;
+        }
+        // median of three, which leaves both sides nonempty
+        data_t a = data[0], b = data[n / 2], c = data[n - 1];
+        data_t pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+        int i = -1, j = n;
+        while (true)
+        {
+            do
+            {
+                i++;
+            } while (data[i] < pivot);
+            do
+            {
+                j--;
+            } while (data[j] > pivot);
+            if (i >= j)
+            {
+                break;
+            }
+            std::swap(data[i], data[j]);
+        }
+        // data[0, j] <= pivot <= data[j + 1, n); the smaller side recurses
+        int left = j + 1;
+        if (left < n - left)
+        {
+            serialQuickSort(left, data, depth);
+            data += left;
+            n -= left;
+        }
+        else
+        {
+            serialQuickSort(n - left, data + left, depth);
+            n = left;
+        }
+    }
+    sortBlock(n, data, data);
+}
+
+// sorts data, with buffer as scratch space of the same size (or null if
+// no partition is done in parallel)
+void quickSort(int leaf, int n, data_t *data, data_t *buffer)
+{
+    if (n <= leaf)
+    {
+        // twice the number of bits in n
+        serialQuickSort(n, data, 2 * (32 - __builtin_clz(n | 1)));
+        return;
+    }
+
+    data_t pivot = samplePivot(n, data);
+    int sizes[2];
+    if (buffer && n >= PARALLEL_PARTITION_MIN)
+    {
+        parallelPartition(n, data, buffer, pivot, sizes);
+    }
+    else
+    {
+        serialPartition(n, data, pivot, sizes);
+    }
+    int right = sizes[0] + sizes[1];
+
+#pragma omp task
+    quickSort(leaf, sizes[0], data, buffer);
+#pragma omp task
+    quickSort(leaf, n - right, data + right, buffer ? buffer + right : nullptr);
+}
+
+/*
+Parallel LSD radix sort, 11 bits of the key per pass. Every thread owns a
+contiguous chunk of the array. In each pass the threads count the digits of
+their chunk, the counts are turned into one output offset per (digit,
+thread) so that the pass is stable, and every thread scatters its chunk to
+the other buffer. Scattered keys first go to a cache line sized buffer per
+digit, which is written out whole when it is full, so that the 2048 output
+streams do not evict each other from the cache. Passes over a digit that is
+the same in all keys are skipped. When sorting pairs, each key's payload is
+buffered and scattered along with it, as a separate array, so a pass moves
+only the bytes of the keys and payloads themselves. Wider payloads are
+sorted as the 32-bit indices of the pairs and gathered afterwards, and since
+the sort is stable, it also serves the argsort.
+*/
+
+constexpr int RADIX_BITS = 11;
+constexpr int RADIX = 1 << RADIX_BITS;
+constexpr int RADIX_PASSES = (64 + RADIX_BITS - 1) / RADIX_BITS;
+constexpr int LINE_KEYS = 64 / sizeof(data_t);
+
+static inline int digit(data_t key, int pass)
+{
+    return (key >> (pass * RADIX_BITS)) & (RADIX - 1);
+}
+
+// the payloads of a line of keys are buffered next to it
+struct RadixLines
+{
+    alignas(64) data_t line[RADIX][LINE_KEYS];
+    alignas(64) std::uint32_t value[RADIX][LINE_KEYS];
+    int fill[RADIX];
+};
+
+// scatters src[begin, end), and its payloads srcValues[begin, end) if
+// PAYLOAD, by digit to dst and dstValues, starting at offset[d] for digit d
+template <bool PAYLOAD>
+static void scatter(const data_t *src, data_t *dst, const std::uint32_t *srcValues, std::uint32_t *dstValues,
+                    int begin, int end, int pass, int *offset, RadixLines &lines)
+{
+    auto &line = lines.line;
+    auto &value = lines.value;
+    int *fill = lines.fill;
+    std::fill(fill, fill + RADIX, 0);
+    for (int i = begin; i < end; i++)
+    {
+        data_t key = src[i];
+        int d = digit(key, pass);
+        if (PAYLOAD)
+        {
+            value[d][fill[d]] = srcValues[i];
+        }
+        line[d][fill[d]++] = key;
+        if (fill[d] == LINE_KEYS)
+        {
+            std::memcpy(dst + offset[d], line[d], sizeof(line[d]));
+            if (PAYLOAD)
+            {
+                std::memcpy(dstValues + offset[d], value[d], sizeof(value[d]));
+            }
+            offset[d] += LINE_KEYS;
+            fill[d] = 0;
+        }
+    }
+    for (int d = 0; d < RADIX; d++)
+    {
+        std::memcpy(dst + offset[d], line[d], fill[d] * sizeof(data_t));
+        if (PAYLOAD)
+        {
+            std::memcpy(dstValues + offset[d], value[d], fill[d] * sizeof(std::uint32_t));
+        }
+        offset[d] += fill[d];
+    }
+}
+
+// sorts data, moving values[i] along with data[i] unless values is null; stable
+static void radixSort(int n, data_t *data, std::uint32_t *values = nullptr)
 {
-    int thread = static_cast<int>((std::log2(omp_get_max_threads())) * 2);
+    if (n < 2)
+    {
+        return;
+    }
+    // bits that differ between some keys
+    data_t any = 0, all = ~data_t(0);
+#pragma omp parallel for reduction(|:any) reduction(&:all)
+    for (int i = 0; i < n; i++)
+    {
+        any |= data[i];
+        all &= data[i];
+    }
+    int passes[RADIX_PASSES], passCount = 0;
+    for (int pass = 0; pass < RADIX_PASSES; pass++)
+    {
+        if (digit(any ^ all, pass) != 0)
+        {
+            passes[passCount++] = pass;
+        }
+    }
+    if (passCount == 0)
+    {
+        return;
+    }
+
+    Array<data_t> buffer(n);
+    Array<std::uint32_t> valueBuffer(values ? n : 0);
+    // offset[u * RADIX + d]: where thread u scatters digit d
+    Array<int> offset(omp_get_max_threads() * RADIX);
+
 #pragma omp parallel
     {
+        const int threads = omp_get_num_threads(), t = omp_get_thread_num();
+        data_t *src = data, *dst = buffer.get();
+        std::uint32_t *srcValues = values, *dstValues = valueBuffer.get();
+        Array<RadixLines> lines(1);
+        const int begin = (long long)n * t / threads, end = (long long)n * (t + 1) / threads;
+        int *count = &offset[t * RADIX];
+        for (int p = 0; p < passCount; p++)
+        {
+            const int pass = passes[p];
+            std::fill(count, count + RADIX, 0);
+            for (int i = begin; i < end; i++)
+            {
+                count[digit(src[i], pass)]++;
+            }
+#pragma omp barrier
 #pragma omp single
-        quickSort(thread, n, data);
-#pragma omp taskwait
+            {
+                int sum = 0;
+                for (int d = 0; d < RADIX; d++)
+                {
+                    for (int u = 0; u < threads; u++)
+                    {
+                        int c = offset[u * RADIX + d];
+                        offset[u * RADIX + d] = sum;
+                        sum += c;
+                    }
+                }
+            }
+            if (values)
+            {
+                scatter<true>(src, dst, srcValues, dstValues, begin, end, pass, count, lines[0]);
+            }
+            else
+            {
+                scatter<false>(src, dst, srcValues, dstValues, begin, end, pass, count, lines[0]);
+            }
+#pragma omp barrier
+            std::swap(src, dst);
+            std::swap(srcValues, dstValues);
+        }
+        if (src != data)
+        {
+            std::copy(src + begin, src + end, data + begin);
+            if (values)
+            {
+                std::copy(srcValues + begin, srcValues + end, values + begin);
+            }
+        }
+    }
+}
+
+/*
+Samplesort. Splitters are picked from a random sample of OVERSAMPLING keys
+per bucket, and stored as an implicit binary search tree so that a key is
+classified with SAMPLE_LOG_BUCKETS comparisons whose results are used as
+array indices instead of branches; several keys are classified at once so
+that their searches overlap (as in super scalar sample sort). Every bucket
+between two splitters is followed by an equality bucket for the keys equal
+to its upper splitter; equality buckets need no sorting, which handles
+heavy duplicates. The threads classify their chunks, take offsets per
+(bucket, thread) from a prefix sum, and scatter to a buffer; the buckets
+are then sorted independently by the network sort back into the array.
+*/
+
+constexpr int SAMPLE_LOG_BUCKETS = 8;
+constexpr int SAMPLE_BUCKETS = 1 << SAMPLE_LOG_BUCKETS;
+constexpr int OVERSAMPLING = 16;
+constexpr int SAMPLESORT_MIN = 1 << 12;
+
+struct Splitters
+{
+    data_t tree[SAMPLE_BUCKETS];  // tree[1 .. SAMPLE_BUCKETS)
+    data_t upper[SAMPLE_BUCKETS]; // upper splitter of each bucket
+
+    // splitter[1 .. SAMPLE_BUCKETS) are the splitters in sorted order
+    explicit Splitters(const data_t *splitter)
+    {
+        for (int i = 1; i < SAMPLE_BUCKETS; i++)
+        {
+            int level = 31 - __builtin_clz(i), pos = i - (1 << level);
+            tree[i] = splitter[(2 * pos + 1) * (SAMPLE_BUCKETS >> (level + 1))];
+        }
+        for (int b = 0; b + 1 < SAMPLE_BUCKETS; b++)
+        {
+            upper[b] = splitter[b + 1];
+        }
+        // keys of the last bucket are above its lower splitter
+        upper[SAMPLE_BUCKETS - 1] = splitter[SAMPLE_BUCKETS - 1];
+    }
+
+    // 2 b for keys between splitters b and b + 1, 2 b + 1 for keys equal to splitter b + 1
+    void classify(const data_t *keys, int n, uint16_t *bucket) const
+    {
+        constexpr int UNROLL = 4;
+        int i = 0;
+        for (; i + UNROLL <= n; i += UNROLL)
+        {
+            int j[UNROLL];
+            for (int u = 0; u < UNROLL; u++)
+            {
+                j[u] = 1;
+            }
+            for (int level = 0; level < SAMPLE_LOG_BUCKETS; level++)
+            {
+                for (int u = 0; u < UNROLL; u++)
+                {
+                    j[u] = 2 * j[u] + (keys[i + u] > tree[j[u]]);
+                }
+            }
+            for (int u = 0; u < UNROLL; u++)
+            {
+                int b = j[u] - SAMPLE_BUCKETS;
+                bucket[i + u] = 2 * b + (keys[i + u] == upper[b]);
+            }
+        }
+        for (; i < n; i++)
+        {
+            int j = 1;
+            for (int level = 0; level < SAMPLE_LOG_BUCKETS; level++)
+            {
+                j = 2 * j + (keys[i] > tree[j]);
+            }
+            int b = j - SAMPLE_BUCKETS;
+            bucket[i] = 2 * b + (keys[i] == upper[b]);
+        }
+    }
+};
+
+static void sampleSort(int n, data_t *data)
+{
+    // the buffer is also the scratch space of the network sorts
+    Array<data_t> buffer(n);
+    if (n < SAMPLESORT_MIN)
+    {
+        networkSort(n, data, buffer.get(), false);
+        return;
+    }
+
+    // splitters from a random sample
+    constexpr int SAMPLES = SAMPLE_BUCKETS * OVERSAMPLING;
+    data_t sample[SAMPLES];
+    unsigned long long state = 0x9e3779b97f4a7c15ULL;
+    for (data_t &x : sample)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        x = data[(state >> 33) % n];
+    }
+    networkSort(SAMPLES, sample, buffer.get(), false);
+    data_t splitter[SAMPLE_BUCKETS];
+    for (int b = 1; b < SAMPLE_BUCKETS; b++)
+    {
+        splitter[b] = sample[b * OVERSAMPLING];
+    }
+    const Splitters splitters(splitter);
+
+    constexpr int BUCKETS = 2 * SAMPLE_BUCKETS;
+    Array<uint16_t> bucket(n);
+    // offset[u * BUCKETS + b]: where thread u scatters bucket b
+    Array<int> offset(omp_get_max_threads() * BUCKETS);
+    int start[BUCKETS + 1];
+
+#pragma omp parallel
+    {
+        const int threads = omp_get_num_threads(), t = omp_get_thread_num();
+        const int begin = (long long)n * t / threads, end = (long long)n * (t + 1) / threads;
+        splitters.classify(data + begin, end - begin, bucket.get() + begin);
+        int *count = &offset[t * BUCKETS];
+        std::fill(count, count + BUCKETS, 0);
+        for (int i = begin; i < end; i++)
+        {
+            count[bucket[i]]++;
+        }
+#pragma omp barrier
+#pragma omp single
+        {
+            int sum = 0;
+            for (int b = 0; b < BUCKETS; b++)
+            {
+                start[b] = sum;
+                for (int u = 0; u < threads; u++)
+                {
+                    int c = offset[u * BUCKETS + b];
+                    offset[u * BUCKETS + b] = sum;
+                    sum += c;
+                }
+            }
+            start[BUCKETS] = sum;
+        }
+        for (int i = begin; i < end; i++)
+        {
+            buffer[count[bucket[i]]++] = data[i];
+        }
+#pragma omp barrier
+
+#pragma omp for schedule(dynamic, 1)
+        for (int b = 0; b < BUCKETS; b++)
+        {
+            data_t *first = buffer.get() + start[b], *last = buffer.get() + start[b + 1];
+            if (b % 2 == 0)
+            {
+                networkSort(last - first, first, data + start[b], true);
+            }
+            else
+            {
+                std::copy(first, last, data + start[b]);
+            }
+        }
+    }
+}
+
+/*
+In-place parallel MSD radix sort, 8 bits per level, whose extra memory is
+counters per thread and bucket. A range is partitioned by its digit in place,
+with bucket boundaries from a parallel count, and the keys are moved in
+rounds as in PARADIS: every thread takes an equal share of what is left of
+each bucket, and swaps every key of its shares into the next free place of
+its bucket among the same thread's shares, giving up on a bucket when the
+share of the key's bucket is full. Each bucket then moves the keys that do
+not belong to it behind those that do, and the next round works on the rest.
+A round on one thread always completes, which finishes the last few keys.
+Ranges with a large part of the keys are partitioned by all threads, one at
+a time; the smaller buckets of each are then sorted by the threads
+independently, partitioning serially down to blocks for the sorting network.
+*/
+
+constexpr int INPLACE_BITS = 8;
+constexpr int INPLACE_BUCKETS = 1 << INPLACE_BITS;
+constexpr int INPLACE_PARALLEL_MIN = 1 << 16;
+
+static inline int inplaceDigit(data_t key, int shift)
+{
+    return (key >> shift) & (INPLACE_BUCKETS - 1);
+}
+
+// American flag sort: partitions data by the digit at shift, then the buckets by the next digits
+static void serialInplaceSort(int n, data_t *data, int shift)
+{
+    if (n <= NETWORK_MAX)
+    {
+        sortBlock(n, data, data);
+        return;
+    }
+    int count[INPLACE_BUCKETS] = {0};
+    for (int i = 0; i < n; i++)
+    {
+        count[inplaceDigit(data[i], shift)]++;
+    }
+    int head[INPLACE_BUCKETS], end[INPLACE_BUCKETS];
+    int sum = 0;
+    for (int b = 0; b < INPLACE_BUCKETS; b++)
+    {
+        head[b] = sum;
+        sum += count[b];
+        end[b] = sum;
+    }
+    for (int b = 0; b < INPLACE_BUCKETS; b++)
+    {
+        while (head[b] < end[b])
+        {
+            int d = inplaceDigit(data[head[b]], shift);
+            if (d == b)
+            {
+                head[b]++;
+            }
+            else
+            {
+                std::swap(data[head[b]], data[head[d]++]);
+            }
+        }
+    }
+    if (shift == 0)
+    {
+        return;
+    }
+    for (int b = 0, begin = 0; b < INPLACE_BUCKETS; begin = end[b++])
+    {
+        serialInplaceSort(end[b] - begin, data + begin, shift - INPLACE_BITS);
     }
-}
\ No newline at end of file
+}
+
+// one round of the parallel partition on shares threads; head[b] advances
+// over the keys that are in their bucket [.., end[b])
+static void inplaceRound(data_t *data, int shift, int shares, int *head, const int *end)
+{
+#pragma omp parallel num_threads(shares)
+    {
+        const int t = omp_get_thread_num(), threads = omp_get_num_threads();
+        int next[INPLACE_BUCKETS], last[INPLACE_BUCKETS];
+        for (int b = 0; b < INPLACE_BUCKETS; b++)
+        {
+            const long long left = end[b] - head[b];
+            next[b] = head[b] + left * t / threads;
+            last[b] = head[b] + left * (t + 1) / threads;
+        }
+#pragma omp barrier
+        for (int b = 0; b < INPLACE_BUCKETS; b++)
+        {
+            while (next[b] < last[b])
+            {
+                int d = inplaceDigit(data[next[b]], shift);
+                if (d == b)
+                {
+                    next[b]++;
+                }
+                else if (next[d] < last[d])
+                {
+                    std::swap(data[next[b]], data[next[d]++]);
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+#pragma omp barrier
+        // the keys of each bucket to its front
+#pragma omp for schedule(dynamic, 1)
+        for (int b = 0; b < INPLACE_BUCKETS; b++)
+        {
+            int i = head[b], j = end[b] - 1;
+            while (true)
+            {
+                while (i <= j && inplaceDigit(data[i], shift) == b)
+                {
+                    i++;
+                }
+                while (i < j && inplaceDigit(data[j], shift) != b)
+                {
+                    j--;
+                }
+                if (i >= j)
+                {
+                    break;
+                }
+                std::swap(data[i], data[j]);
+            }
+            head[b] = i;
+        }
+    }
+}
+
+// partitions data by the digit at shift with all threads; bucket b becomes [bound[b], bound[b + 1])
+static void parallelInplacePartition(int n, data_t *data, int shift, int *bound)
+{
+    // count[t * INPLACE_BUCKETS + b]: keys of bucket b in the chunk of thread t
+    const int maxThreads = omp_get_max_threads();
+    Array<int> count(maxThreads * INPLACE_BUCKETS);
+    std::fill(count.get(), count.get() + maxThreads * INPLACE_BUCKETS, 0);
+    int threads = 1;
+#pragma omp parallel
+    {
+        const int t = omp_get_thread_num();
+#pragma omp single
+        threads = omp_get_num_threads();
+        const int begin = (long long)n * t / threads, end = (long long)n * (t + 1) / threads;
+        for (int i = begin; i < end; i++)
+        {
+            count[t * INPLACE_BUCKETS + inplaceDigit(data[i], shift)]++;
+        }
+    }
+    int head[INPLACE_BUCKETS], end[INPLACE_BUCKETS];
+    int sum = 0;
+    for (int b = 0; b < INPLACE_BUCKETS; b++)
+    {
+        head[b] = bound[b] = sum;
+        for (int t = 0; t < threads; t++)
+        {
+            sum += count[t * INPLACE_BUCKETS + b];
+        }
+        end[b] = sum;
+    }
+    bound[INPLACE_BUCKETS] = n;
+
+    long long left = n;
+    while (left > 0)
+    {
+        // a round that does not place much is not worth its threads
+        int shares = left >= INPLACE_PARALLEL_MIN ? threads : 1;
+        inplaceRound(data, shift, shares, head, end);
+        long long placed = left;
+        left = 0;
+        for (int b = 0; b < INPLACE_BUCKETS; b++)
+        {
+            left += end[b] - head[b];
+        }
+        placed -= left;
+        if (shares > 1 && placed < left / 8)
+        {
+            inplaceRound(data, shift, 1, head, end);
+            break;
+        }
+    }
+}
+
+// whether a range of m of the n keys is too large for one thread of its own
+static inline bool wideRange(int m, int n, int threads)
+{
+    return threads > 1 && m >= INPLACE_PARALLEL_MIN && 2LL * threads * m > n;
+}
+
+// partitions data by the digit at shift with all threads, then sorts the
+// buckets that are not wide ranges one per thread, and the others likewise
+static void wideInplaceSort(int m, data_t *data, int shift, int n, int threads)
+{
+    int bound[INPLACE_BUCKETS + 1];
+    parallelInplacePartition(m, data, shift, bound);
+    if (shift == 0)
+    {
+        return;
+    }
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int b = 0; b < INPLACE_BUCKETS; b++)
+    {
+        const int size = bound[b + 1] - bound[b];
+        if (size > 1 && !wideRange(size, n, threads))
+        {
+            serialInplaceSort(size, data + bound[b], shift - INPLACE_BITS);
+        }
+    }
+    for (int b = 0; b < INPLACE_BUCKETS; b++)
+    {
+        const int size = bound[b + 1] - bound[b];
+        if (wideRange(size, n, threads))
+        {
+            wideInplaceSort(size, data + bound[b], shift - INPLACE_BITS, n, threads);
+        }
+    }
+}
+
+static void inplaceSort(int n, data_t *data)
+{
+    if (n < 2)
+    {
+        return;
+    }
+    // the top digit is the highest one that differs between some keys
+    data_t any = 0, all = ~data_t(0);
+#pragma omp parallel for reduction(|:any) reduction(&:all)
+    for (int i = 0; i < n; i++)
+    {
+        any |= data[i];
+        all &= data[i];
+    }
+    if (any == all)
+    {
+        return;
+    }
+    const int top = (63 - __builtin_clzll(any ^ all)) / INPLACE_BITS * INPLACE_BITS;
+    const int threads = omp_get_max_threads();
+
+    if (wideRange(n, n, threads))
+    {
+        wideInplaceSort(n, data, top, n, threads);
+    }
+    else
+    {
+        serialInplaceSort(n, data, top);
+    }
+}
+
+// sorts with the backend, without looking for runs
+static void sortWith(sort_backend backend, int n, data_t *data)
+{
+    if (backend == sort_backend::radix)
+    {
+        radixSort(n, data);
+        return;
+    }
+    if (backend == sort_backend::samplesort)
+    {
+        sampleSort(n, data);
+        return;
+    }
+    if (backend == sort_backend::inplace)
+    {
+        inplaceSort(n, data);
+        return;
+    }
+    if (backend == sort_backend::network)
+    {
+        Array<data_t> buffer(n);
+        networkSort(n, data, buffer.get(), false);
+        return;
+    }
+
+    const int threads = omp_get_max_threads();
+    // about eight leaves per thread; a single thread has nothing to split for
+    int leaf = threads == 1 ? n : std::max(LEAF_MIN, n / (8 * threads));
+    Array<data_t> buffer(threads > 1 && n >= PARALLEL_PARTITION_MIN ? n : 0);
+#pragma omp parallel
+    {
+#pragma omp single
+        quickSort(leaf, n, data, buffer.get());
+#pragma omp taskwait
+    }
+}
+
+/*
+Merging. A merge of two sorted arrays is split into pieces of about equal
+output size by merge path co-ranking: for the output position d, the binary
+search finds the split i + j = d of the inputs such that the first d outputs
+are exactly a[0, i) and b[0, j). The pieces are merged by independent tasks.
+*/
+
+constexpr int MERGE_GRAIN = 1 << 16;
+
+// number of elements taken from a among the first d outputs of merging a and b
+static int coRank(int d, const data_t *a, int na, const data_t *b, int nb)
+{
+    int lo = std::max(0, d - nb), hi = std::min(d, na);
+    while (lo < hi)
+    {
+        int i = (lo + hi) / 2;
+        // ties go to a first, as in std::merge
+        if (a[i] <= b[d - i - 1])
+        {
+            lo = i + 1;
+        }
+        else
+        {
+            hi = i;
+        }
+    }
+    return lo;
+}
+
+// merges a and b to out, in parallel pieces
+static void parallelMerge(const data_t *a, int na, const data_t *b, int nb, data_t *out)
+{
+    const int n = na + nb;
+    const int pieces = std::min(omp_get_max_threads(), n / MERGE_GRAIN + 1);
+    for (int k = 0; k < pieces; k++)
+    {
+#pragma omp task
+        {
+            int d0 = (long long)n * k / pieces, d1 = (long long)n * (k + 1) / pieces;
+            int i0 = coRank(d0, a, na, b, nb), i1 = coRank(d1, a, na, b, nb);
+            vectorMerge(a + i0, i1 - i0, b + d0 - i0, (d1 - i1) - (d0 - i0), out + d0);
+        }
+    }
+#pragma omp taskwait
+}
+
+/*
+Presorted runs. Before sorting, a parallel scan looks for maximal
+non-decreasing and strictly decreasing runs of at least MIN_RUN keys. Any
+such run contains a whole aligned block of MIN_RUN / 2 keys, so the scan only
+tests whether each block is monotone, which takes a few comparisons on
+unsorted keys, and the first monotone block of a run extends it in both
+directions. If the runs cover at least a quarter of the keys, the
+descending runs are reversed, the keys between runs are sorted with the
+backend, and the resulting sorted segments are merged in a balanced tree:
+every merge splits its segments at the boundary nearest to the middle of its
+keys, as in powersort, and the levels alternate between data and a buffer as
+in mergesort.
+*/
+
+constexpr int MIN_RUN = 1 << 14;
+constexpr int RUN_BLOCK = MIN_RUN / 2;
+constexpr int COPY_GRAIN = 1 << 16;
+
+struct Run
+{
+    int begin, end;
+    bool descending;
+};
+
+static inline bool inOrder(data_t x, data_t y, bool descending)
+{
+    return descending ? x > y : x <= y;
+}
+
+// end of the run that contains keys i and i + 1, looking no further than n
+static int runEnd(int n, const data_t *data, int i, bool descending)
+{
+    int j = i + 1;
+    while (j < n && inOrder(data[j - 1], data[j], descending))
+    {
+        j++;
+    }
+    return j;
+}
+
+// the runs of data, to runs[0, count), with room for one run per block; returns count
+static int findRuns(int n, const data_t *data, Run *runs)
+{
+    const int blocks = n / RUN_BLOCK;
+    // the run that block k reports, at runs[k]
+    std::fill(runs, runs + blocks, Run{0, 0, false});
+
+#pragma omp parallel
+    {
+        const int threads = omp_get_num_threads(), t = omp_get_thread_num();
+        const int first = (long long)blocks * t / threads, last = (long long)blocks * (t + 1) / threads;
+        int covered = 0;
+        for (int k = first; k < last; k++)
+        {
+            const int b = k * RUN_BLOCK;
+            // a run in the other direction can start on the last key of the previous one
+            if (b < covered - 1)
+            {
+                continue;
+            }
+            for (bool descending : {false, true})
+            {
+                if (runEnd(b + RUN_BLOCK, data, b, descending) < b + RUN_BLOCK)
+                {
+                    continue;
+                }
+                int begin = b;
+                while (begin > 0 && begin > b - RUN_BLOCK && inOrder(data[begin - 1], data[begin], descending))
+                {
+                    begin--;
+                }
+                // the previous block is monotone too, and reports the run
+                if (b > 0 && begin == b - RUN_BLOCK)
+                {
+                    break;
+                }
+                int end = runEnd(n, data, b, descending);
+                if (end - begin >= MIN_RUN)
+                {
+                    runs[k] = {begin, end, descending};
+                }
+                covered = end;
+                break;
+            }
+        }
+    }
+
+    // an ascending and a descending run can share one key
+    int count = 0;
+    for (int k = 0; k < blocks; k++)
+    {
+        Run run = runs[k];
+        if (run.end == 0)
+        {
+            continue;
+        }
+        if (count > 0)
+        {
+            run.begin = std::max(run.begin, runs[count - 1].end);
+        }
+        if (run.end - run.begin >= MIN_RUN)
+        {
+            runs[count++] = run;
+        }
+    }
+    return count;
+}
+
+static void parallelCopy(const data_t *from, int n, data_t *to)
+{
+#pragma omp taskloop
+    for (int i = 0; i < n; i += COPY_GRAIN)
+    {
+        std::copy(from + i, from + std::min(n, i + COPY_GRAIN), to + i);
+    }
+}
+
+static void parallelReverse(int n, data_t *data)
+{
+#pragma omp taskloop
+    for (int i = 0; i < n / 2; i += COPY_GRAIN)
+    {
+        for (int k = i; k < std::min(n / 2, i + COPY_GRAIN); k++)
+        {
+            std::swap(data[k], data[n - 1 - k]);
+        }
+    }
+}
+
+// merges the sorted segments [bound[lo], bound[lo + 1]), ..., [bound[hi - 1],
+// bound[hi]) of data; the result is in buffer if toBuffer, and in data otherwise
+static void mergeSegments(const int *bound, int lo, int hi, data_t *data, data_t *buffer, bool toBuffer)
+{
+    const int begin = bound[lo], end = bound[hi];
+    if (hi - lo == 1)
+    {
+        if (toBuffer)
+        {
+            parallelCopy(data + begin, end - begin, buffer + begin);
+        }
+        return;
+    }
+
+    // the inner boundary nearest to the middle
+    int mid = std::lower_bound(bound + lo + 1, bound + hi, begin + (end - begin) / 2) - bound;
+    if (mid == hi || (mid > lo + 1 && 2 * bound[mid] - begin - end > begin + end - 2 * bound[mid - 1]))
+    {
+        mid--;
+    }
+
+#pragma omp task
+    mergeSegments(bound, lo, mid, data, buffer, !toBuffer);
+
+#pragma omp task
+    mergeSegments(bound, mid, hi, data, buffer, !toBuffer);
+
+#pragma omp taskwait
+    const data_t *from = toBuffer ? data : buffer;
+    parallelMerge(from + begin, bound[mid] - begin, from + bound[mid], end - bound[mid], (toBuffer ? buffer : data) + begin);
+}
+
+// the runs of data as findRuns finds them if they have at least a quarter of
+// its keys; returns their count, or 0
+static int presortedRuns(int n, const data_t *data, Run *runs)
+{
+    STATS(long long t0 = stats_clock());
+    const int count = findRuns(n, data, runs);
+    long long runKeys = 0;
+    for (int r = 0; r < count; r++)
+    {
+        runKeys += runs[r].end - runs[r].begin;
+    }
+    STATS(sort_stats.detect_ns += stats_clock() - t0);
+    if (runKeys == 0 || runKeys < n / 4)
+    {
+        return 0;
+    }
+    STATS(sort_stats.runs += count; sort_stats.run_keys += runKeys);
+    return count;
+}
+
+// merges runs[0, count) of data with the sorted keys between them; the
+// sorted segments are [bound[s], bound[s + 1]) for s < segments
+static void mergeRuns(int n, data_t *data, const Run *runs, int count, const int *bound, int segments)
+{
+    STATS(long long t0 = stats_clock());
+    Array<data_t> buffer(n);
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+            for (int r = 0; r < count; r++)
+            {
+                if (runs[r].descending)
+                {
+                    STATS(sort_stats.descending_runs++);
+                    parallelReverse(runs[r].end - runs[r].begin, data + runs[r].begin);
+                }
+            }
+            mergeSegments(bound, 0, segments, data, buffer.get(), false);
+        }
+    }
+    STATS(sort_stats.merge_ns += stats_clock() - t0);
+}
+
+void psort(int n, data_t *data, sort_backend backend)
+{
+    // merging runs needs a buffer
+    Array<Run> runs(n / RUN_BLOCK);
+    const int count = backend != sort_backend::inplace ? presortedRuns(n, data, runs.get()) : 0;
+
+    // sorted segments: the runs and the sorted keys between them; with a
+    // single call of sortWith, its backends are compiled only once
+    Array<int> bound(2 * count + 2);
+    int segments = 0;
+    bound[0] = 0;
+    for (int r = 0; r <= count; r++)
+    {
+        const int end = r < count ? runs[r].begin : n;
+        if (end > bound[segments])
+        {
+            sortWith(backend, end - bound[segments], data + bound[segments]);
+            bound[++segments] = end;
+        }
+        if (r < count)
+        {
+            bound[++segments] = runs[r].end;
+        }
+    }
+    if (count > 0)
+    {
+        mergeRuns(n, data, runs.get(), count, bound.get(), segments);
+    }
+}
+
+void psort(int n, data_t *data)
+{
+    psort(n, data, sort_backend::native);
+}
+
+void psort_pairs(int n, data_t *keys, std::uint32_t *values)
+{
+    radixSort(n, keys, values);
+}
+
+// sorts the keys with the indices of their values, which are then gathered
+template <typename V>
+static void sortByIndex(int n, data_t *keys, V *values)
+{
+    Array<std::uint32_t> index(n);
+    Array<V> copy(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++)
+    {
+        index[i] = i;
+        copy[i] = values[i];
+    }
+    radixSort(n, keys, index.get());
+#pragma omp parallel for
+    for (int i = 0; i < n; i++)
+    {
+        values[i] = copy[index[i]];
+    }
+}
+
+void psort_pairs(int n, data_t *keys, std::uint64_t *values)
+{
+    sortByIndex(n, keys, values);
+}
+
+void psort_pairs(int n, data_t *keys, payload16 *values)
+{
+    sortByIndex(n, keys, values);
+}
+
+void argsort(int n, const data_t *keys, int *index)
+{
+    Array<data_t> copy(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++)
+    {
+        copy[i] = keys[i];
+        index[i] = i;
+    }
+    // int and unsigned int may alias each other
+    radixSort(n, copy.get(), reinterpret_cast<std::uint32_t *>(index));
+}
+
+/*
+External sorting. The input file is read in chunks of a quarter of the
+memory budget, each chunk is sorted by psort and written to a file of runs
+at its own offset, while the next chunk is already being read and the
+previous run is still being written. Evenly spaced samples of the runs give
+splitter keys that cut the merge into one piece per thread, and binary
+searches in the runs find where every piece starts in each run and thus in
+the output, so the pieces are merged independently. A piece merges its parts
+of the runs with a loser tree; every run and the output are accessed in
+blocks through two buffers, and a thread of the stream reads or writes one
+of them while the other is in use.
+*/
+
+constexpr int RUN_SAMPLES = 256;
+constexpr long long EXTERNAL_CHUNK_MIN = 1 << 4;
+constexpr long long EXTERNAL_BLOCK_MIN = 1 << 10;
+
+// reads bytes from fd at offset; returns false on errors
+static bool readAt(int fd, data_t *buffer, long long bytes, long long offset)
+{
+    char *p = reinterpret_cast<char *>(buffer);
+    while (bytes > 0)
+    {
+        ssize_t done = pread(fd, p, bytes, offset);
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return false;
+        }
+        p += done;
+        bytes -= done;
+        offset += done;
+    }
+    return true;
+}
+
+// writes bytes to fd at offset; returns false on errors
+static bool writeAt(int fd, const data_t *buffer, long long bytes, long long offset)
+{
+    const char *p = reinterpret_cast<const char *>(buffer);
+    while (bytes > 0)
+    {
+        ssize_t done = pwrite(fd, p, bytes, offset);
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return false;
+        }
+        p += done;
+        bytes -= done;
+        offset += done;
+    }
+    return true;
+}
+
+struct File
+{
+    int fd;
+    explicit File(int fd) : fd(fd) {}
+    File(const File &) = delete;
+    File &operator=(const File &) = delete;
+    ~File()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+};
+
+// A thread that reads and writes blocks for one stream, one at a time, in
+// the background; if it cannot be started, the transfers run in the caller.
+// The streams call it from many places, so its members are not inlined.
+class Transfer
+{
+  public:
+    __attribute__((noinline)) Transfer()
+    {
+        pthread_mutex_init(&mutex, nullptr);
+        pthread_cond_init(&ready, nullptr);
+        pthread_cond_init(&done, nullptr);
+        running = pthread_create(&worker, nullptr, run, this) == 0;
+    }
+    Transfer(const Transfer &) = delete;
+    Transfer &operator=(const Transfer &) = delete;
+
+    // the thread finishes its transfer before it stops
+    __attribute__((noinline)) ~Transfer()
+    {
+        if (running)
+        {
+            pthread_mutex_lock(&mutex);
+            stop = true;
+            pthread_cond_signal(&ready);
+            pthread_mutex_unlock(&mutex);
+            pthread_join(worker, nullptr);
+        }
+        pthread_cond_destroy(&done);
+        pthread_cond_destroy(&ready);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    // starts reading bytes at offset of fd to buffer, or writing them from
+    // buffer if write, once the previous transfer is done
+    __attribute__((noinline)) void start(bool write, int fd, data_t *buffer, long long bytes, long long offset)
+    {
+        const Job next = {write, fd, buffer, bytes, offset};
+        if (!running)
+        {
+            ok = ok && next.transfer();
+            return;
+        }
+        pthread_mutex_lock(&mutex);
+        while (busy)
+        {
+            pthread_cond_wait(&done, &mutex);
+        }
+        job = next;
+        busy = true;
+        pthread_cond_signal(&ready);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // waits for the last transfer; returns false if any of them failed
+    __attribute__((noinline)) bool wait()
+    {
+        pthread_mutex_lock(&mutex);
+        while (busy)
+        {
+            pthread_cond_wait(&done, &mutex);
+        }
+        bool good = ok;
+        pthread_mutex_unlock(&mutex);
+        return good;
+    }
+
+  private:
+    struct Job
+    {
+        bool write;
+        int fd;
+        data_t *buffer;
+        long long bytes, offset;
+
+        bool transfer() const { return write ? writeAt(fd, buffer, bytes, offset) : readAt(fd, buffer, bytes, offset); }
+    };
+
+    static void *run(void *self)
+    {
+        Transfer &t = *static_cast<Transfer *>(self);
+        pthread_mutex_lock(&t.mutex);
+        while (true)
+        {
+            while (!t.busy && !t.stop)
+            {
+                pthread_cond_wait(&t.ready, &t.mutex);
+            }
+            if (!t.busy)
+            {
+                break;
+            }
+            pthread_mutex_unlock(&t.mutex);
+            bool good = t.job.transfer();
+            pthread_mutex_lock(&t.mutex);
+            t.ok = t.ok && good;
+            t.busy = false;
+            pthread_cond_signal(&t.done);
+        }
+        pthread_mutex_unlock(&t.mutex);
+        return nullptr;
+    }
+
+    pthread_mutex_t mutex;
+    pthread_cond_t ready, done;
+    pthread_t worker;
+    Job job = {};
+    bool running = false, busy = false, stop = false, ok = true;
+};
+
+// keys [begin, end) of a file, with the next block read in the background
+class BlockReader
+{
+  public:
+    // starts reading the keys; a reader is opened once
+    void open(int fd, long long begin, long long end, long long blockKeys)
+    {
+        this->fd = fd;
+        next = begin;
+        this->end = end;
+        this->blockKeys = blockKeys;
+        current.reset(blockKeys);
+        spare.reset(blockKeys);
+        prefetch();
+        fetch();
+    }
+
+    bool empty() const { return pos == size; }
+    data_t front() const { return current[pos]; }
+    bool good() const { return ok; }
+
+    void pop()
+    {
+        if (++pos == size)
+        {
+            fetch();
+        }
+    }
+
+  private:
+    // starts reading the block at next to spare
+    void prefetch()
+    {
+        pending = std::min(blockKeys, end - next);
+        if (pending > 0)
+        {
+            io.start(false, fd, spare.get(), pending * (long long)sizeof(data_t), next * (long long)sizeof(data_t));
+        }
+        next += pending;
+    }
+
+    // makes the prefetched block current
+    void fetch()
+    {
+        pos = 0;
+        size = pending;
+        if (size > 0)
+        {
+            ok &= io.wait();
+            current.swap(spare);
+            prefetch();
+        }
+    }
+
+    int fd = -1;
+    long long next = 0, end = 0, blockKeys = 0;
+    long long pos = 0, size = 0, pending = 0;
+    bool ok = true;
+    Array<data_t> current, spare;
+    // after the buffers, so that it stops before they are freed
+    Transfer io;
+};
+
+// keys written to a file from offset on, with the full block written in the background
+class BlockWriter
+{
+  public:
+    BlockWriter(int fd, long long offset, long long blockKeys)
+        : fd(fd), offset(offset), blockKeys(blockKeys),
+          current(blockKeys), spare(blockKeys)
+    {
+    }
+
+    void push(data_t key)
+    {
+        current[size++] = key;
+        if (size == blockKeys)
+        {
+            flush();
+        }
+    }
+
+    // writes the rest and waits; returns false on errors
+    bool finish()
+    {
+        flush();
+        return io.wait();
+    }
+
+  private:
+    // the write of the previous block is done when the next one starts, so
+    // that the spare buffer is free
+    void flush()
+    {
+        if (size > 0)
+        {
+            io.start(true, fd, current.get(), size * (long long)sizeof(data_t), offset * (long long)sizeof(data_t));
+            offset += size;
+            current.swap(spare);
+            size = 0;
+        }
+    }
+
+    int fd;
+    long long offset, blockKeys;
+    long long size = 0;
+    Array<data_t> current, spare;
+    Transfer io;
+};
+
+// tournament tree over runs: node[0] is the run with the smallest key,
+// node[1 .. k) hold the losers of the matches, run r is leaf k + r; the
+// nodes keep the keys of their runs, so that matches do not look at the runs
+class LoserTree
+{
+  public:
+    LoserTree(BlockReader *runs, int k) : runs(runs), k(k), node(k)
+    {
+        std::fill(node.get(), node.get() + k, Entry{0, -1, false});
+        for (int r = 0; r < k; r++)
+        {
+            Entry winner = entry(r);
+            for (int p = (k + r) / 2; p > 0; p /= 2)
+            {
+                if (node[p].run < 0)
+                {
+                    node[p] = winner;
+                    winner.run = -1;
+                    break;
+                }
+                if (before(node[p], winner))
+                {
+                    std::swap(node[p], winner);
+                }
+            }
+            if (winner.run >= 0)
+            {
+                node[0] = winner;
+            }
+        }
+    }
+
+    bool empty() const { return node[0].done; }
+    data_t top() const { return node[0].key; }
+
+    void pop()
+    {
+        const int r = node[0].run;
+        runs[r].pop();
+        Entry winner = entry(r);
+        for (int p = (k + r) / 2; p > 0; p /= 2)
+        {
+            if (before(node[p], winner))
+            {
+                std::swap(node[p], winner);
+            }
+        }
+        node[0] = winner;
+    }
+
+  private:
+    // the key of a run, if it is not done
+    struct Entry
+    {
+        data_t key;
+        int run;
+        bool done;
+    };
+
+    Entry entry(int r) const
+    {
+        return runs[r].empty() ? Entry{0, r, true} : Entry{runs[r].front(), r, false};
+    }
+
+    // whether the key of a goes out before that of b
+    static bool before(const Entry &a, const Entry &b)
+    {
+        if (a.done || b.done)
+        {
+            return b.done && !a.done;
+        }
+        return a.key < b.key || (a.key == b.key && a.run < b.run);
+    }
+
+    BlockReader *runs;
+    int k;
+    Array<Entry> node;
+};
+
+// first position in [begin, end) of the sorted keys in fd whose key is at least key
+static long long lowerBound(int fd, long long begin, long long end, data_t key, bool &ok)
+{
+    while (begin < end)
+    {
+        long long mid = begin + (end - begin) / 2;
+        data_t x = 0;
+        ok &= readAt(fd, &x, sizeof(data_t), mid * (long long)sizeof(data_t));
+        if (x < key)
+        {
+            begin = mid + 1;
+        }
+        else
+        {
+            end = mid;
+        }
+    }
+    return begin;
+}
+
+bool psort_file(const char *input, const char *output, long long memory, sort_backend backend)
+{
+    File in(open(input, O_RDONLY));
+    struct stat info, outputInfo;
+    if (in.fd < 0 || fstat(in.fd, &info) != 0)
+    {
+        return false;
+    }
+    // truncating the output must not destroy the input
+    if (stat(output, &outputInfo) == 0 && outputInfo.st_dev == info.st_dev && outputInfo.st_ino == info.st_ino)
+    {
+        return false;
+    }
+    File out(open(output, O_RDWR | O_CREAT | O_TRUNC, 0644));
+    if (out.fd < 0)
+    {
+        return false;
+    }
+    const long long n = info.st_size / sizeof(data_t);
+    if (n == 0)
+    {
+        return true;
+    }
+
+    // three chunks in the pipeline, and the buffer of psort
+    const long long chunkKeys = std::min({n, std::max(EXTERNAL_CHUNK_MIN, memory / (4 * (long long)sizeof(data_t))),
+                                          (long long)INT_MAX});
+    const int runCount = (n + chunkKeys - 1) / chunkKeys;
+    auto runBegin = [&](int r) { return std::min(n, r * chunkKeys); };
+
+    // a single run is the output; the file of runs is gone when closed
+    Array<char> runPath(std::strlen(output) + sizeof(".runs"));
+    std::strcat(std::strcpy(runPath.get(), output), ".runs");
+    File runs(runCount == 1 ? dup(out.fd) : open(runPath.get(), O_RDWR | O_CREAT | O_TRUNC, 0600));
+    if (runs.fd < 0)
+    {
+        return false;
+    }
+    if (runCount > 1)
+    {
+        unlink(runPath.get());
+    }
+
+    bool ok = true;
+    Array<data_t> samples(runCount * RUN_SAMPLES);
+    {
+        Array<data_t> chunk[3];
+        for (int b = 0; b < std::min(3, runCount); b++)
+        {
+            chunk[b].reset(chunkKeys);
+        }
+        Transfer reading, writing;
+        auto read = [&](int r)
+        {
+            reading.start(false, in.fd, chunk[r % 3].get(), (runBegin(r + 1) - runBegin(r)) * (long long)sizeof(data_t),
+                          runBegin(r) * (long long)sizeof(data_t));
+        };
+        read(0);
+        for (int r = 0; r < runCount; r++)
+        {
+            ok &= reading.wait();
+            if (r + 1 < runCount)
+            {
+                // the write of the run in this buffer ended before that of the previous round began
+                read(r + 1);
+            }
+            const int m = runBegin(r + 1) - runBegin(r);
+            data_t *keys = chunk[r % 3].get();
+            psort(m, keys, backend);
+            for (int j = 0; j < RUN_SAMPLES; j++)
+            {
+                samples[r * RUN_SAMPLES + j] = keys[(long long)m * j / RUN_SAMPLES];
+            }
+            writing.start(true, runs.fd, keys, m * (long long)sizeof(data_t), runBegin(r) * (long long)sizeof(data_t));
+        }
+        ok &= writing.wait();
+    }
+    if (!ok || runCount == 1)
+    {
+        return ok;
+    }
+
+    const int pieces = omp_get_max_threads();
+    psort(runCount * RUN_SAMPLES, samples.get());
+    // start[p * runCount + r]: where piece p starts in run r
+    Array<long long> start((pieces + 1) * runCount), offset(pieces + 1);
+    std::fill(offset.get(), offset.get() + pieces + 1, 0);
+    for (int r = 0; r < runCount; r++)
+    {
+        start[r] = runBegin(r);
+        start[pieces * runCount + r] = runBegin(r + 1);
+    }
+#pragma omp parallel for reduction(&&:ok)
+    for (int p = 1; p < pieces; p++)
+    {
+        data_t splitter = samples[(long long)runCount * RUN_SAMPLES * p / pieces];
+        for (int r = 0; r < runCount; r++)
+        {
+            start[p * runCount + r] = lowerBound(runs.fd, runBegin(r), runBegin(r + 1), splitter, ok);
+        }
+    }
+    for (int p = 0; p <= pieces; p++)
+    {
+        for (int r = 0; r < runCount; r++)
+        {
+            offset[p] += start[p * runCount + r] - runBegin(r);
+        }
+    }
+
+    // two buffers for each run and for the output, in every piece
+    const long long blockKeys = std::max(EXTERNAL_BLOCK_MIN,
+                                         memory / (long long)sizeof(data_t) / (2LL * pieces * (runCount + 1)));
+#pragma omp parallel for schedule(dynamic, 1) reduction(&&:ok)
+    for (int p = 0; p < pieces; p++)
+    {
+        Array<BlockReader> readers(runCount);
+        for (int r = 0; r < runCount; r++)
+        {
+            readers[r].open(runs.fd, start[p * runCount + r], start[(p + 1) * runCount + r], blockKeys);
+        }
+        LoserTree tree(readers.get(), runCount);
+        BlockWriter writer(out.fd, offset[p], blockKeys);
+        while (!tree.empty())
+        {
+            writer.push(tree.top());
+            tree.pop();
+        }
+        ok = writer.finish() && ok;
+        for (int r = 0; r < runCount; r++)
+        {
+            ok = readers[r].good() && ok;
+        }
+    }
+    return ok;
+}